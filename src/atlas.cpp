@@ -0,0 +1,209 @@
+/* Graphics drawing program
+ *
+ * Copyright (C) 2019 Martin & Diana
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Atlas: a grid of small Julia sets, one constant per cell.
+// Cells are taken ATLAS_LANES at a time and the same pixel of each goes
+// into one lane, so a batch runs one c per lane through the same loop.
+// The lanes are GCC vectors of SSE2 width, the widest every x86-64 has;
+// wider ones get their compares split into scalar code. Instead of
+// branches every lane keeps a compare mask that is all ones while it is
+// live, and each step adds (live & 1.0) to its count. Escaped lanes go on
+// iterating until the whole batch is done, their z running off to inf
+// and NaN, which never passes the live test again. Threads pull
+// (cell group, row band) tiles from a shared counter.
+
+#define ATLAS_LANES 8
+#define ATLAS_VECTOR 2
+#define ATLAS_VECTORS (ATLAS_LANES / ATLAS_VECTOR)
+#define ATLAS_BAND 8
+#define ATLAS_THREADS 8
+
+typedef r64 r64_vector __attribute__ ((vector_size (ATLAS_VECTOR * sizeof (r64))));
+typedef s64 s64_vector __attribute__ ((vector_size (ATLAS_VECTOR * sizeof (s64))));
+
+
+struct Atlas {
+    r64 *constants;     // x, y per cell
+    u32 cells_count;
+    u32 columns, rows;
+    u32 cell_size;
+    u32 max_iterations;
+    u32 *counts;        // mosaic, bottom row first like Image
+    u32 mosaic_w, mosaic_h;
+
+    SDL_atomic_t next_tile;
+    u32 tiles_count;
+    u32 bands;
+};
+
+
+static void
+atlas_batch (Atlas *atlas, u32 first_cell, u32 x, u32 y)
+{
+    r64_vector cx[ATLAS_VECTORS], cy[ATLAS_VECTORS], R[ATLAS_VECTORS];
+    r64_vector zx[ATLAS_VECTORS], zy[ATLAS_VECTORS], count[ATLAS_VECTORS];
+    s64_vector live[ATLAS_VECTORS];
+    const r64_vector zero = {};
+    const s64_vector one = (s64_vector) (zero + 1);
+
+    // Same mapping as a View of cell_size pixels at scale 0.25, centered
+    r64 step = 1.0/(atlas->cell_size* 0.25);
+    r64 start_x = (r64) ((s32) x - (s32) atlas->cell_size/2) * step;
+    r64 start_y = (r64) ((s32) y - (s32) atlas->cell_size/2) * step;
+
+    for (u32 k = 0; k < ATLAS_LANES; k++)
+    {
+        // Lanes past the last cell repeat it and are dropped below
+        u32 cell = first_cell + k < atlas->cells_count ? first_cell + k : atlas->cells_count - 1;
+        r64 constant_x = atlas->constants[2*cell];
+        r64 constant_y = atlas->constants[2*cell + 1];
+        cx[k / ATLAS_VECTOR][k % ATLAS_VECTOR] = constant_x;
+        cy[k / ATLAS_VECTOR][k % ATLAS_VECTOR] = constant_y;
+        R[k / ATLAS_VECTOR][k % ATLAS_VECTOR] = escape_radius (constant_x, constant_y);
+    }
+
+    for (u32 v = 0; v < ATLAS_VECTORS; v++)
+    {
+        zx[v] = zero + start_x;
+        zy[v] = zero + start_y;
+        count[v] = zero;
+        live[v] = zx[v]*zx[v] + zy[v]*zy[v] <= R[v];
+    }
+
+    for (u32 i = 1; i <= atlas->max_iterations; i++)
+    {
+        s64_vector any_live = {};
+#pragma GCC unroll 4
+        for (u32 v = 0; v < ATLAS_VECTORS; v++)
+        {
+            r64_vector x_test = zx[v];
+            r64_vector y_test = zy[v];
+            zx[v] = x_test*x_test - y_test*y_test + cx[v];
+            zy[v] = 2*x_test * y_test + cy[v];
+            count[v] += (r64_vector) (live[v] & one);
+            live[v] &= zx[v]*zx[v] + zy[v]*zy[v] <= R[v];
+            any_live |= live[v];
+        }
+
+        s64 live_lanes = 0;
+        for (u32 k = 0; k < ATLAS_VECTOR; k++) live_lanes |= any_live[k];
+        if (!live_lanes) break;
+    }
+
+    for (u32 k = 0; k < ATLAS_LANES && first_cell + k < atlas->cells_count; k++)
+    {
+        u32 cell = first_cell + k;
+        u32 column = cell % atlas->columns;
+        u32 row = atlas->rows - 1 - cell / atlas->columns;
+        u32 mosaic_x = column * atlas->cell_size + x;
+        u32 mosaic_y = row * atlas->cell_size + y;
+        atlas->counts[(size_t) mosaic_y * atlas->mosaic_w + mosaic_x] =
+            live[k / ATLAS_VECTOR][k % ATLAS_VECTOR] ?
+            ITERATIONS_INSIDE : (u32) count[k / ATLAS_VECTOR][k % ATLAS_VECTOR];
+    }
+}
+
+
+static int
+atlas_worker (void *data)
+{
+    Atlas *atlas = (Atlas *) data;
+    for (;;)
+    {
+        u32 tile = SDL_AtomicAdd (&atlas->next_tile, 1);
+        if (tile >= atlas->tiles_count) break;
+
+        u32 first_cell = (tile / atlas->bands) * ATLAS_LANES;
+        u32 y0 = (tile % atlas->bands) * ATLAS_BAND;
+        u32 y1 = y0 + ATLAS_BAND < atlas->cell_size ? y0 + ATLAS_BAND : atlas->cell_size;
+        for (u32 y = y0; y < y1; y++)
+        {
+            for (u32 x = 0; x < atlas->cell_size; x++) atlas_batch (atlas, first_cell, x, y);
+        }
+    }
+    return 0;
+}
+
+
+// Renders every constant into a cell_size square of the mosaic
+static void
+render_atlas (Atlas *atlas, r64 *constants, u32 cells_count, u32 cell_size, u32 max_iterations)
+{
+    atlas->constants = constants;
+    atlas->cells_count = cells_count;
+    atlas->cell_size = cell_size;
+    atlas->max_iterations = max_iterations;
+    atlas->columns = (u32) ceil (sqrt ((r64) cells_count));
+    atlas->rows = (cells_count + atlas->columns - 1) / atlas->columns;
+    atlas->mosaic_w = atlas->columns * cell_size;
+    atlas->mosaic_h = atlas->rows * cell_size;
+
+    size_t pixels_count = (size_t) atlas->mosaic_w * atlas->mosaic_h;
+    atlas->counts = (u32 *) malloc (pixels_count * sizeof (u32));
+    // Unused cells at the end of the last row stay outside
+    for (size_t i = 0; i < pixels_count; i++) atlas->counts[i] = 0;
+
+    atlas->bands = (cell_size + ATLAS_BAND - 1) / ATLAS_BAND;
+    atlas->tiles_count = (cells_count + ATLAS_LANES - 1) / ATLAS_LANES * atlas->bands;
+    SDL_AtomicSet (&atlas->next_tile, 0);
+
+    SDL_Thread *threads[ATLAS_THREADS];
+    for (u32 i = 0; i < ATLAS_THREADS; i++) threads[i] = SDL_CreateThread (atlas_worker, "atlas", atlas);
+    atlas_worker (atlas);
+    for (u32 i = 0; i < ATLAS_THREADS; i++)
+    {
+        if (threads[i]) SDL_WaitThread (threads[i], 0);
+    }
+}
+
+
+// n * n constants on a plain grid over [-2, 0.5] x [-1.25, 1.25], the box
+// around the Mandelbrot set; top row first
+static r64 *
+mandelbrot_sweep (u32 n)
+{
+    r64 *constants = (r64 *) malloc (2 * n * n * sizeof (r64));
+    for (u32 row = 0; row < n; row++)
+    {
+        for (u32 column = 0; column < n; column++)
+        {
+            r64 t_x = n > 1 ? (r64) column / (n - 1) : 0.5;
+            r64 t_y = n > 1 ? (r64) row / (n - 1) : 0.5;
+            constants[2*(row*n + column)]     = -2.0 + 2.5*t_x;
+            constants[2*(row*n + column) + 1] =  1.25 - 2.5*t_y;
+        }
+    }
+    return constants;
+}
+
+
+// Writes "cell column row constant_x constant_y" lines, column and row counted from the top left
+static bool
+write_atlas_index (Atlas *atlas, const char *filename)
+{
+    FILE *file = fopen (filename, "w");
+    if (!file) return false;
+    fprintf (file, "# cell column row constant_x constant_y (cells are %u px)\n", atlas->cell_size);
+    for (u32 i = 0; i < atlas->cells_count; i++)
+    {
+        fprintf (file, "%u %u %u %.17g %.17g\n", i, i % atlas->columns, i / atlas->columns,
+                 atlas->constants[2*i], atlas->constants[2*i + 1]);
+    }
+    fclose (file);
+    return true;
+}
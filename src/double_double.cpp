@@ -0,0 +1,217 @@
+/* Graphics drawing program
+ *
+ * Copyright (C) 2019 Martin & Diana
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Double-double numbers: value = hi + lo with |lo| <= ulp(hi)/2, about 106 bits.
+// The error-free transforms below only use + - *, so they need IEEE rounding
+// (no -ffast-math) but no FMA.
+// Deep views keep their center as a double-double and every pixel is
+// center + offset, so pixels stay apart long after r64 would merge them.
+
+// Below this pixel spacing plain r64 pixels start to smear together
+#define DD_PIXEL_SPACING 1e-13
+
+
+struct DD {
+    r64 hi, lo;
+};
+
+
+static inline DD
+two_sum (r64 a, r64 b)
+{
+    r64 s = a + b;
+    r64 v = s - a;
+    r64 e = (a - (s - v)) + (b - v);
+    return {s, e};
+}
+
+
+static inline DD
+quick_two_sum (r64 a, r64 b)
+{
+    r64 s = a + b;
+    r64 e = b - (s - a);
+    return {s, e};
+}
+
+
+// Dekker's product: splits both factors into 26-bit halves
+static inline DD
+two_prod (r64 a, r64 b)
+{
+    const r64 split = 134217729.0; // 2^27 + 1
+    r64 p = a * b;
+    r64 ta = split * a;
+    r64 a_hi = ta - (ta - a);
+    r64 a_lo = a - a_hi;
+    r64 tb = split * b;
+    r64 b_hi = tb - (tb - b);
+    r64 b_lo = b - b_hi;
+    r64 e = ((a_hi * b_hi - p) + a_hi * b_lo + a_lo * b_hi) + a_lo * b_lo;
+    return {p, e};
+}
+
+
+static inline DD
+dd_add (DD a, DD b)
+{
+    DD s = two_sum (a.hi, b.hi);
+    DD t = two_sum (a.lo, b.lo);
+    s.lo += t.hi;
+    s = quick_two_sum (s.hi, s.lo);
+    s.lo += t.lo;
+    return quick_two_sum (s.hi, s.lo);
+}
+
+
+static inline DD
+dd_mul (DD a, DD b)
+{
+    DD p = two_prod (a.hi, b.hi);
+    p.lo += a.hi * b.lo + a.lo * b.hi;
+    return quick_two_sum (p.hi, p.lo);
+}
+
+
+static inline DD
+dd_mul_d (DD a, r64 b)
+{
+    DD p = two_prod (a.hi, b);
+    p.lo += a.lo * b;
+    return quick_two_sum (p.hi, p.lo);
+}
+
+
+static inline DD
+dd_neg (DD a)
+{
+    return {-a.hi, -a.lo};
+}
+
+
+static inline DD
+dd_div_d (DD a, r64 b)
+{
+    r64 q1 = a.hi / b;
+    DD r = dd_add (a, dd_neg (two_prod (q1, b)));
+    r64 q2 = r.hi / b;
+    r = dd_add (r, dd_neg (two_prod (q2, b)));
+    r64 q3 = r.hi / b;
+    DD q = quick_two_sum (q1, q2);
+    return dd_add (q, {q3, 0});
+}
+
+
+// Significant digits kept by dd_from_string(), a few past the ~32 of a DD
+#define DD_DECIMAL_DIGITS 36
+// Decimal exponents past r64's range: above the largest, below the smallest
+#define DD_DECIMAL_MAX 309
+#define DD_DECIMAL_MIN -325
+
+
+// Parses a decimal like "-0.74543000000000000012345" or "1.5e-20" to full
+// double-double precision; returns false if text is not a number or is
+// too large for r64. Values too small for r64 read as 0.
+static bool
+dd_from_string (const char *text, DD *value)
+{
+    const char *p = text;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+') p++;
+
+    // value = mantissa * 10^exponent, mantissa holding at most
+    // DD_DECIMAL_DIGITS significant digits
+    DD mantissa = {0, 0};
+    s32 exponent = 0;
+    s32 significant = 0;
+    bool digits = false;
+    bool fraction = false;
+    for (; (*p >= '0' && *p <= '9') || (*p == '.' && !fraction); p++)
+    {
+        if (*p == '.')
+        {
+            fraction = true;
+            continue;
+        }
+        digits = true;
+        if (significant == DD_DECIMAL_DIGITS)
+        {
+            if (!fraction) exponent++;
+            continue;
+        }
+        mantissa = dd_add (dd_mul_d (mantissa, 10.0), {(r64) (*p - '0'), 0});
+        if (fraction) exponent--;
+        if (mantissa.hi != 0) significant++;
+    }
+    if (!digits) return false;
+
+    if (*p == 'e' || *p == 'E')
+    {
+        char *end;
+        long power = strtol (p + 1, &end, 10);
+        if (end == p + 1) return false;
+        p = end;
+        // Anything past these is out of range whatever the mantissa, and
+        // clamping keeps the sum below inside s32
+        if (power > 2 * DD_DECIMAL_MAX) power = 2 * DD_DECIMAL_MAX;
+        if (power < 2 * DD_DECIMAL_MIN) power = 2 * DD_DECIMAL_MIN;
+        exponent += (s32) power;
+    }
+    if (*p != '\0') return false;
+
+    // mantissa < 10^significant, so this bounds the scaling loops
+    if (significant == 0 || exponent + significant < DD_DECIMAL_MIN)
+    {
+        *value = {negative ? -0.0 : 0.0, 0};
+        return true;
+    }
+    if (exponent + significant > DD_DECIMAL_MAX) return false;
+
+    for (; exponent > 0; exponent--) mantissa = dd_mul_d (mantissa, 10.0);
+    for (; exponent < 0; exponent++) mantissa = dd_div_d (mantissa, 10.0);
+    if (!isfinite (mantissa.hi)) return false;
+
+    *value = negative ? dd_neg (mantissa) : mantissa;
+    return true;
+}
+
+
+// Pixel p of a view size pixels wide sits at center + (p - size/2) / (size * scale)
+static inline DD
+pixel_coordinate (DD center, u32 p, u32 size, r64 scale)
+{
+    r64 step = 1.0/(size* scale);
+    return dd_add (center, two_prod ((r64) ((s32) p - (s32) (size/2)), step));
+}
+
+
+// Center moved by the given number of pixels
+static DD
+move_center (DD center, s32 pixels, u32 size, r64 scale)
+{
+    r64 step = 1.0/(size* scale);
+    return dd_add (center, two_prod ((r64) pixels, step));
+}
+
+
+static bool
+use_double_double (u32 image_w, u32 image_h, r64 scale)
+{
+    u32 size = image_w > image_h ? image_w : image_h;
+    return 1.0 / (size * scale) < DD_PIXEL_SPACING;
+}
@@ -0,0 +1,651 @@
+/* Graphics drawing program
+ *
+ * Copyright (C) 2019 Martin & Diana
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Background image export.
+// export_image() only copies the picture into one of EXPORT_SLOTS
+// preallocated slots and returns; a writer thread encodes and saves it.
+// PNG data is compressed in EXPORT_CHUNK_SIZE pieces by a pool of deflate
+// threads started with the exporter, each piece a fixed-Huffman deflate
+// block ending on a byte boundary, so the pieces simply join into one
+// zlib stream.
+
+#define EXPORT_SLOTS 2
+#define EXPORT_DEFLATE_THREADS 4
+#define EXPORT_CHUNK_SIZE (256 * 1024)
+#define EXPORT_HASH_BITS 15
+#define EXPORT_MAX_CHAIN 32
+
+
+enum ExportFormat {
+    EXPORT_PPM,
+    EXPORT_PNG,
+};
+
+
+struct ExportJob {
+    bool busy;
+    u32 sequence;
+    ExportFormat format;
+    char filename[256];
+    u32 w, h;
+    u8 *rgb;            // top row first, as on screen
+    u32 *counts;
+    bool has_counts;
+    size_t pixels_max;
+};
+
+
+struct DeflateChunk {
+    const u8 *data;
+    u32 size;
+    bool last;
+    u8 *out;
+    u32 out_size;
+};
+
+
+struct DeflatePool;
+
+
+struct DeflateWorker {
+    DeflatePool *pool;
+    SDL_Thread *thread;
+    s32 *head;
+    s32 *prev;
+};
+
+
+// workers[0] has no thread, its share is done by whoever calls deflate_chunks()
+struct DeflatePool {
+    SDL_mutex *mutex;
+    SDL_cond *start;
+    SDL_cond *done;
+    bool quit;
+    DeflateChunk *chunks;
+    u32 chunks_count;
+    u32 next;           // first chunk nobody took yet
+    u32 pending;        // chunks not finished yet
+    DeflateWorker workers[EXPORT_DEFLATE_THREADS];
+};
+
+
+struct Exporter {
+    SDL_Thread *thread;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    bool quit;
+    u32 sequence;
+    u32 failures;       // jobs write_export() could not save
+    ExportJob jobs[EXPORT_SLOTS];
+
+    // Only touched by the writer thread
+    u8 *filtered;
+    size_t filtered_max;
+    DeflateChunk *chunks;
+    u32 chunks_max;
+    DeflatePool deflate;
+};
+
+
+static u32 crc_table[256];
+
+static const u16 length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const u8 length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const u16 distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                      257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                      8193, 12289, 16385, 24577};
+static const u8 distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                      7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+
+struct BitWriter {
+    u8 *out;
+    u32 size;
+    u64 bits;
+    u32 count;
+};
+
+
+static inline void
+put_bits (BitWriter *writer, u32 value, u32 n)
+{
+    writer->bits |= (u64) value << writer->count;
+    writer->count += n;
+    while (writer->count >= 8)
+    {
+        writer->out[writer->size++] = (u8) writer->bits;
+        writer->bits >>= 8;
+        writer->count -= 8;
+    }
+}
+
+
+static void
+flush_bits (BitWriter *writer)
+{
+    if (writer->count > 0) writer->out[writer->size++] = (u8) writer->bits;
+    writer->bits = 0;
+    writer->count = 0;
+}
+
+
+// Huffman codes go out most significant bit first
+static inline void
+put_code (BitWriter *writer, u32 code, u32 n)
+{
+    u32 reversed = 0;
+    for (u32 i = 0; i < n; i++) reversed |= ((code >> i) & 1) << (n - 1 - i);
+    put_bits (writer, reversed, n);
+}
+
+
+static inline void
+put_symbol (BitWriter *writer, u32 symbol)
+{
+    if      (symbol < 144) put_code (writer, 0x30 + symbol, 8);
+    else if (symbol < 256) put_code (writer, 0x190 + symbol - 144, 9);
+    else if (symbol < 280) put_code (writer, symbol - 256, 7);
+    else                   put_code (writer, 0xc0 + symbol - 280, 8);
+}
+
+
+static void
+put_match (BitWriter *writer, u32 length, u32 distance)
+{
+    u32 l = 28;
+    while (length_base[l] > length) l--;
+    put_symbol (writer, 257 + l);
+    put_bits (writer, length - length_base[l], length_extra[l]);
+
+    u32 d = 29;
+    while (distance_base[d] > distance) d--;
+    put_code (writer, d, 5);
+    put_bits (writer, distance - distance_base[d], distance_extra[d]);
+}
+
+
+static inline u32
+hash3 (const u8 *p)
+{
+    return ((p[0] << 10) ^ (p[1] << 5) ^ p[2]) & ((1 << EXPORT_HASH_BITS) - 1);
+}
+
+
+static void
+deflate_chunk (DeflateChunk *chunk, s32 *head, s32 *prev)
+{
+    const u8 *data = chunk->data;
+    s32 size = chunk->size;
+    BitWriter writer = {chunk->out, 0, 0, 0};
+
+    for (u32 i = 0; i < (1 << EXPORT_HASH_BITS); i++) head[i] = -1;
+
+    put_bits (&writer, chunk->last ? 1 : 0, 1);
+    put_bits (&writer, 1, 2); // fixed Huffman codes
+
+    for (s32 i = 0; i < size;)
+    {
+        s32 best_length = 0;
+        s32 best_distance = 0;
+
+        if (i + 3 <= size)
+        {
+            u32 h = hash3 (data + i);
+            s32 max_length = size - i < 258 ? size - i : 258;
+            s32 chain = 0;
+            for (s32 p = head[h]; p >= 0 && i - p <= 32768 && chain < EXPORT_MAX_CHAIN; p = prev[p], chain++)
+            {
+                s32 length = 0;
+                while (length < max_length && data[p + length] == data[i + length]) length++;
+                if (length > best_length)
+                {
+                    best_length = length;
+                    best_distance = i - p;
+                    if (length == max_length) break;
+                }
+            }
+            prev[i] = head[h];
+            head[h] = i;
+        }
+
+        if (best_length >= 3)
+        {
+            put_match (&writer, best_length, best_distance);
+            for (s32 k = i + 1; k < i + best_length && k + 3 <= size; k++)
+            {
+                u32 h = hash3 (data + k);
+                prev[k] = head[h];
+                head[h] = k;
+            }
+            i += best_length;
+        }
+        else
+        {
+            put_symbol (&writer, data[i]);
+            i++;
+        }
+    }
+
+    put_symbol (&writer, 256);
+
+    // An empty stored block byte-aligns the stream so the next chunk can follow
+    if (!chunk->last)
+    {
+        put_bits (&writer, 0, 3);
+        flush_bits (&writer);
+        writer.out[writer.size++] = 0x00;
+        writer.out[writer.size++] = 0x00;
+        writer.out[writer.size++] = 0xff;
+        writer.out[writer.size++] = 0xff;
+    }
+    flush_bits (&writer);
+    chunk->out_size = writer.size;
+}
+
+
+// Called and returns with pool->mutex locked
+static void
+deflate_free_chunks (DeflateWorker *worker)
+{
+    DeflatePool *pool = worker->pool;
+    while (pool->next < pool->chunks_count)
+    {
+        DeflateChunk *chunk = &pool->chunks[pool->next++];
+        SDL_UnlockMutex (pool->mutex);
+        deflate_chunk (chunk, worker->head, worker->prev);
+        SDL_LockMutex (pool->mutex);
+        if (--pool->pending == 0) SDL_CondSignal (pool->done);
+    }
+}
+
+
+static int
+deflate_worker (void *data)
+{
+    DeflateWorker *worker = (DeflateWorker *) data;
+    DeflatePool *pool = worker->pool;
+
+    SDL_LockMutex (pool->mutex);
+    for (;;)
+    {
+        deflate_free_chunks (worker);
+        if (pool->quit) break;
+        SDL_CondWait (pool->start, pool->mutex);
+    }
+    SDL_UnlockMutex (pool->mutex);
+    return 0;
+}
+
+
+// Compresses every chunk with the pool's threads and the calling one
+static void
+deflate_chunks (DeflatePool *pool, DeflateChunk *chunks, u32 chunks_count)
+{
+    SDL_LockMutex (pool->mutex);
+    pool->chunks = chunks;
+    pool->chunks_count = chunks_count;
+    pool->next = 0;
+    pool->pending = chunks_count;
+    SDL_CondBroadcast (pool->start);
+
+    deflate_free_chunks (&pool->workers[0]);
+    while (pool->pending > 0) SDL_CondWait (pool->done, pool->mutex);
+    pool->chunks_count = 0;
+    SDL_UnlockMutex (pool->mutex);
+}
+
+
+static u32
+crc32_update (u32 crc, const u8 *data, size_t size)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+static u32
+adler32 (const u8 *data, size_t size)
+{
+    u32 a = 1, b = 0;
+    while (size > 0)
+    {
+        size_t block = size < 5552 ? size : 5552;
+        for (size_t i = 0; i < block; i++)
+        {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += block;
+        size -= block;
+    }
+    return (b << 16) | a;
+}
+
+
+static void
+put_u32_be (u8 *p, u32 value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+
+static void
+write_png_chunk (FILE *file, const char *type, const u8 *data, u32 size)
+{
+    u8 header[8];
+    put_u32_be (header, size);
+    memcpy (header + 4, type, 4);
+    fwrite (header, 1, 8, file);
+    if (size) fwrite (data, 1, size, file);
+
+    u8 crc[4];
+    put_u32_be (crc, crc32_update (crc32_update (0, (const u8 *) type, 4), data, size));
+    fwrite (crc, 1, 4, file);
+}
+
+
+static bool
+write_png (Exporter *exporter, ExportJob *job, FILE *file)
+{
+    // Sub filter on every row: fractal bands are mostly runs of one color
+    u32 row_size = 1 + 3 * job->w;
+    size_t filtered_size = (size_t) row_size * job->h;
+    if (filtered_size > exporter->filtered_max)
+    {
+        exporter->filtered_max = filtered_size;
+        exporter->filtered = (u8 *) realloc (exporter->filtered, filtered_size);
+    }
+    for (u32 y = 0; y < job->h; y++)
+    {
+        u8 *row = exporter->filtered + (size_t) y * row_size;
+        const u8 *src = job->rgb + (size_t) y * 3 * job->w;
+        row[0] = 1;
+        for (u32 x = 0; x < 3 * job->w; x++) row[1 + x] = x < 3 ? src[x] : src[x] - src[x - 3];
+    }
+
+    u32 chunks_count = (filtered_size + EXPORT_CHUNK_SIZE - 1) / EXPORT_CHUNK_SIZE;
+    if (chunks_count > exporter->chunks_max)
+    {
+        exporter->chunks = (DeflateChunk *) realloc (exporter->chunks, chunks_count * sizeof (DeflateChunk));
+        for (u32 i = exporter->chunks_max; i < chunks_count; i++)
+        {
+            exporter->chunks[i].out = (u8 *) malloc (EXPORT_CHUNK_SIZE / 8 * 9 + 64);
+        }
+        exporter->chunks_max = chunks_count;
+    }
+    for (u32 i = 0; i < chunks_count; i++)
+    {
+        DeflateChunk *chunk = &exporter->chunks[i];
+        chunk->data = exporter->filtered + (size_t) i * EXPORT_CHUNK_SIZE;
+        chunk->size = i + 1 < chunks_count ? EXPORT_CHUNK_SIZE : filtered_size - (size_t) i * EXPORT_CHUNK_SIZE;
+        chunk->last = i + 1 == chunks_count;
+    }
+
+    deflate_chunks (&exporter->deflate, exporter->chunks, chunks_count);
+
+    static const u8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    fwrite (signature, 1, 8, file);
+
+    u8 header[13];
+    put_u32_be (header, job->w);
+    put_u32_be (header + 4, job->h);
+    header[8] = 8;      // bits per channel
+    header[9] = 2;      // RGB
+    header[10] = 0;
+    header[11] = 0;
+    header[12] = 0;
+    write_png_chunk (file, "IHDR", header, 13);
+
+    // zlib header, then the chunks as separate IDATs, then the checksum
+    static const u8 zlib_header[2] = {0x78, 0x01};
+    write_png_chunk (file, "IDAT", zlib_header, 2);
+    for (u32 i = 0; i < chunks_count; i++)
+    {
+        write_png_chunk (file, "IDAT", exporter->chunks[i].out, exporter->chunks[i].out_size);
+    }
+    u8 checksum[4];
+    put_u32_be (checksum, adler32 (exporter->filtered, filtered_size));
+    write_png_chunk (file, "IDAT", checksum, 4);
+    write_png_chunk (file, "IEND", 0, 0);
+
+    return !ferror (file);
+}
+
+
+// Encodes and saves one job; exporter only lends its scratch buffers
+static bool
+write_export (Exporter *exporter, ExportJob *job)
+{
+    FILE *file = fopen (job->filename, "wb");
+    bool ok = file != 0;
+    if (ok && job->format == EXPORT_PPM)
+    {
+        fprintf (file, "P6\n%u %u\n255\n", job->w, job->h);
+        ok = fwrite (job->rgb, 3, (size_t) job->w * job->h, file) == (size_t) job->w * job->h;
+    }
+    else if (ok)
+    {
+        ok = write_png (exporter, job, file);
+    }
+    // fclose flushes the tail of the file, so a full disk may only show here
+    if (file && fclose (file) != 0) ok = false;
+
+    if (ok && job->has_counts)
+    {
+        char counts_filename[sizeof (job->filename) + 8];
+        snprintf (counts_filename, sizeof (counts_filename), "%s.counts", job->filename);
+        file = fopen (counts_filename, "wb");
+        ok = file && fwrite (job->counts, sizeof (u32), (size_t) job->w * job->h, file) == (size_t) job->w * job->h;
+        if (file && fclose (file) != 0) ok = false;
+    }
+
+    if (!ok) fprintf (stderr, "Export to %s failed\n", job->filename);
+    return ok;
+}
+
+
+static int
+export_writer (void *data)
+{
+    Exporter *exporter = (Exporter *) data;
+
+    SDL_LockMutex (exporter->mutex);
+    for (;;)
+    {
+        ExportJob *job = 0;
+        for (u32 i = 0; i < EXPORT_SLOTS; i++)
+        {
+            if (exporter->jobs[i].busy && (!job || exporter->jobs[i].sequence < job->sequence))
+            {
+                job = &exporter->jobs[i];
+            }
+        }
+
+        if (!job)
+        {
+            if (exporter->quit) break;
+            SDL_CondWait (exporter->cond, exporter->mutex);
+            continue;
+        }
+
+        SDL_UnlockMutex (exporter->mutex);
+        bool ok = write_export (exporter, job);
+        SDL_LockMutex (exporter->mutex);
+        if (!ok) exporter->failures++;
+        job->busy = false;
+    }
+    SDL_UnlockMutex (exporter->mutex);
+    return 0;
+}
+
+
+// Starts the deflate threads once; write_png() only hands them chunks
+static void
+init_deflate_workers (Exporter *exporter)
+{
+    DeflatePool *pool = &exporter->deflate;
+    pool->mutex = SDL_CreateMutex ();
+    pool->start = SDL_CreateCond ();
+    pool->done = SDL_CreateCond ();
+
+    for (u32 i = 0; i < EXPORT_DEFLATE_THREADS; i++)
+    {
+        DeflateWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->head = (s32 *) malloc ((1 << EXPORT_HASH_BITS) * sizeof (s32));
+        worker->prev = (s32 *) malloc (EXPORT_CHUNK_SIZE * sizeof (s32));
+        // Without a thread its share falls to the others or to the caller
+        worker->thread = i > 0 ? SDL_CreateThread (deflate_worker, "deflate", worker) : 0;
+    }
+}
+
+
+static void
+stop_deflate_workers (Exporter *exporter)
+{
+    DeflatePool *pool = &exporter->deflate;
+    SDL_LockMutex (pool->mutex);
+    pool->quit = true;
+    SDL_CondBroadcast (pool->start);
+    SDL_UnlockMutex (pool->mutex);
+
+    for (u32 i = 0; i < EXPORT_DEFLATE_THREADS; i++)
+    {
+        if (pool->workers[i].thread) SDL_WaitThread (pool->workers[i].thread, 0);
+    }
+}
+
+
+static void
+init_crc_table ()
+{
+    for (u32 n = 0; n < 256; n++)
+    {
+        u32 c = n;
+        for (u32 k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+
+// Preallocates every slot for w * h pixels and starts the writer and deflate threads
+static void
+start_exporter (Exporter *exporter, u32 w, u32 h)
+{
+    init_crc_table ();
+
+    for (u32 i = 0; i < EXPORT_SLOTS; i++)
+    {
+        ExportJob *job = &exporter->jobs[i];
+        job->pixels_max = (size_t) w * h;
+        job->rgb = (u8 *) malloc (job->pixels_max * 3);
+        job->counts = (u32 *) malloc (job->pixels_max * sizeof (u32));
+    }
+    init_deflate_workers (exporter);
+
+    exporter->mutex = SDL_CreateMutex ();
+    exporter->cond = SDL_CreateCond ();
+    exporter->thread = SDL_CreateThread (export_writer, "export", exporter);
+}
+
+
+// Snapshots image (and counts, if given) and queues it for writing.
+// Returns false without blocking when every slot is still being written.
+static bool
+export_image (Exporter *exporter, Image image, u32 *counts,
+              const char *filename, ExportFormat format)
+{
+    ExportJob *job = 0;
+    SDL_LockMutex (exporter->mutex);
+    for (u32 i = 0; i < EXPORT_SLOTS && !job; i++)
+    {
+        if (!exporter->jobs[i].busy) job = &exporter->jobs[i];
+    }
+    SDL_UnlockMutex (exporter->mutex);
+
+    if (!job)
+    {
+        fprintf (stderr, "Export of %s skipped, writer is busy\n", filename);
+        return false;
+    }
+
+    size_t pixels_count = (size_t) image.w * image.h;
+    if (pixels_count > job->pixels_max)
+    {
+        job->pixels_max = pixels_count;
+        job->rgb = (u8 *) realloc (job->rgb, pixels_count * 3);
+        job->counts = (u32 *) realloc (job->counts, pixels_count * sizeof (u32));
+    }
+
+    // Images are stored bottom row first for OpenGL
+    for (u32 y = 0; y < image.h; y++)
+    {
+        memcpy (job->rgb + (size_t) y * 3 * image.w,
+                image.pixels + (size_t) (image.h - 1 - y) * image.w, 3 * image.w);
+    }
+    job->has_counts = counts != 0;
+    if (counts)
+    {
+        for (u32 y = 0; y < image.h; y++)
+        {
+            memcpy (job->counts + (size_t) y * image.w,
+                    counts + (size_t) (image.h - 1 - y) * image.w, image.w * sizeof (u32));
+        }
+    }
+    job->w = image.w;
+    job->h = image.h;
+    job->format = format;
+    snprintf (job->filename, sizeof (job->filename), "%s", filename);
+
+    SDL_LockMutex (exporter->mutex);
+    job->sequence = exporter->sequence++;
+    job->busy = true;
+    SDL_CondSignal (exporter->cond);
+    SDL_UnlockMutex (exporter->mutex);
+    return true;
+}
+
+
+// Finishes the queued exports and stops the writer and deflate threads
+static void
+stop_exporter (Exporter *exporter)
+{
+    SDL_LockMutex (exporter->mutex);
+    exporter->quit = true;
+    SDL_CondSignal (exporter->cond);
+    SDL_UnlockMutex (exporter->mutex);
+    SDL_WaitThread (exporter->thread, 0);
+    stop_deflate_workers (exporter);
+}
+
+
+static ExportFormat
+export_format (const char *filename)
+{
+    size_t length = strlen (filename);
+    if (length >= 4 && strcmp (filename + length - 4, ".ppm") == 0) return EXPORT_PPM;
+    return EXPORT_PNG;
+}
@@ -0,0 +1,322 @@
+/* Graphics drawing program
+ *
+ * Copyright (C) 2019 Martin & Diana
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Local render farm over a Unix domain socket.
+// The coordinator listens on a socket path, cuts the view into tiles and
+// hands one tile at a time to every connected worker. Workers are either
+// forked by the coordinator or started separately (e.g. under numactl)
+// with --worker PATH. A tile held by a worker that disconnects goes back
+// into the queue. Both ends run on one machine, so messages are plain
+// structs in native byte order.
+
+#define FARM_TILE_SIZE 128
+#define FARM_MAX_WORKERS 256
+#define FARM_IDLE_TIMEOUT_MS 10000
+
+
+struct FarmTile {
+    View view;
+    u32 index;
+    u32 x, y, w, h;
+};
+
+
+struct FarmResult {
+    u32 index;
+    u32 count;
+};
+
+
+struct FarmWorker {
+    int socket;
+    s32 tile;   // -1 when idle
+};
+
+
+static bool
+write_all (int fd, const void *data, size_t size)
+{
+    const u8 *bytes = (const u8 *) data;
+    while (size > 0)
+    {
+        ssize_t written = write (fd, bytes, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+
+static bool
+read_all (int fd, void *data, size_t size)
+{
+    u8 *bytes = (u8 *) data;
+    while (size > 0)
+    {
+        ssize_t got = read (fd, bytes, size);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        bytes += got;
+        size -= got;
+    }
+    return true;
+}
+
+
+static bool
+farm_address (const char *path, sockaddr_un *address)
+{
+    memset (address, 0, sizeof (*address));
+    address->sun_family = AF_UNIX;
+    if (strlen (path) >= sizeof (address->sun_path))
+    {
+        fprintf (stderr, "Socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy (address->sun_path, path);
+    return true;
+}
+
+
+// Clears path for a new listener: only a socket nobody answers on is removed
+static bool
+claim_socket_path (const char *path, sockaddr_un *address)
+{
+    struct stat status;
+    if (lstat (path, &status) < 0)
+    {
+        if (errno == ENOENT) return true;
+        fprintf (stderr, "Can't use %s: %s\n", path, strerror (errno));
+        return false;
+    }
+    if (!S_ISSOCK (status.st_mode))
+    {
+        fprintf (stderr, "Can't use %s: not a socket\n", path);
+        return false;
+    }
+
+    int probe = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0)
+    {
+        fprintf (stderr, "Can't use %s: %s\n", path, strerror (errno));
+        return false;
+    }
+    bool live = connect (probe, (sockaddr *) address, sizeof (*address)) == 0;
+    int error = errno;
+    close (probe);
+    if (live)
+    {
+        fprintf (stderr, "Can't use %s: another process is listening on it\n", path);
+        return false;
+    }
+    if (error != ECONNREFUSED && error != ENOENT)
+    {
+        fprintf (stderr, "Can't use %s: %s\n", path, strerror (error));
+        return false;
+    }
+
+    if (unlink (path) < 0 && errno != ENOENT)
+    {
+        fprintf (stderr, "Can't remove %s: %s\n", path, strerror (errno));
+        return false;
+    }
+    return true;
+}
+
+
+// Worker side: render tiles until the coordinator hangs up
+static int
+run_farm_worker (const char *path)
+{
+    sockaddr_un address;
+    if (!farm_address (path, &address)) return 1;
+
+    int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect (fd, (sockaddr *) &address, sizeof (address)) < 0)
+    {
+        fprintf (stderr, "Can't connect to %s: %s\n", path, strerror (errno));
+        return 1;
+    }
+
+    u32 *counts = (u32 *) malloc (FARM_TILE_SIZE * FARM_TILE_SIZE * sizeof (u32));
+
+    FarmTile tile;
+    while (read_all (fd, &tile, sizeof (tile)))
+    {
+        if (tile.w > FARM_TILE_SIZE || tile.h > FARM_TILE_SIZE) break;
+
+        render_tile (tile.view, tile.x, tile.y, tile.w, tile.h, counts);
+
+        FarmResult result = {tile.index, tile.w * tile.h};
+        if (!write_all (fd, &result, sizeof (result)) ||
+                !write_all (fd, counts, result.count * sizeof (u32))) break;
+    }
+
+    free (counts);
+    close (fd);
+    return 0;
+}
+
+
+static FarmTile
+farm_tile (View view, u32 index, u32 tiles_x)
+{
+    FarmTile tile;
+    tile.view = view;
+    tile.index = index;
+    tile.x = (index % tiles_x) * FARM_TILE_SIZE;
+    tile.y = (index / tiles_x) * FARM_TILE_SIZE;
+    tile.w = view.w - tile.x < FARM_TILE_SIZE ? view.w - tile.x : FARM_TILE_SIZE;
+    tile.h = view.h - tile.y < FARM_TILE_SIZE ? view.h - tile.y : FARM_TILE_SIZE;
+    return tile;
+}
+
+
+static bool
+send_farm_tile (FarmWorker *worker, View view, u32 index, u32 tiles_x)
+{
+    FarmTile tile = farm_tile (view, index, tiles_x);
+    worker->tile = index;
+    return write_all (worker->socket, &tile, sizeof (tile));
+}
+
+
+// Coordinator side. Fills counts (view.w * view.h) and returns true
+// when every tile came back.
+static bool
+run_farm (View view, const char *path, u32 local_workers, u32 *counts)
+{
+    sockaddr_un address;
+    if (!farm_address (path, &address) || !claim_socket_path (path, &address)) return false;
+
+    signal (SIGPIPE, SIG_IGN);
+
+    int listener = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 ||
+            bind (listener, (sockaddr *) &address, sizeof (address)) < 0 ||
+            listen (listener, FARM_MAX_WORKERS) < 0)
+    {
+        fprintf (stderr, "Can't listen on %s: %s\n", path, strerror (errno));
+        return false;
+    }
+
+    for (u32 i = 0; i < local_workers; i++)
+    {
+        pid_t pid = fork ();
+        if (pid == 0)
+        {
+            close (listener);
+            _exit (run_farm_worker (path));
+        }
+        if (pid < 0) fprintf (stderr, "fork failed: %s\n", strerror (errno));
+    }
+
+    u32 tiles_x = (view.w + FARM_TILE_SIZE - 1) / FARM_TILE_SIZE;
+    u32 tiles_y = (view.h + FARM_TILE_SIZE - 1) / FARM_TILE_SIZE;
+    u32 tiles_count = tiles_x * tiles_y;
+
+    // Tiles still to hand out; a tile from a lost worker is pushed back here
+    u32 *queue = (u32 *) malloc (tiles_count * sizeof (u32));
+    u32 queue_count = tiles_count;
+    for (u32 i = 0; i < tiles_count; i++) queue[i] = tiles_count - 1 - i;
+
+    u32 *tile_counts = (u32 *) malloc (FARM_TILE_SIZE * FARM_TILE_SIZE * sizeof (u32));
+    FarmWorker workers[FARM_MAX_WORKERS];
+    u32 workers_count = 0;
+    u32 tiles_done = 0;
+    u32 lost_workers = 0;
+    pollfd fds[FARM_MAX_WORKERS + 1];
+
+    while (tiles_done < tiles_count)
+    {
+        for (u32 i = 0; i < workers_count && queue_count > 0; i++)
+        {
+            if (workers[i].tile >= 0) continue;
+            if (!send_farm_tile (&workers[i], view, queue[queue_count - 1], tiles_x))
+            {
+                workers[i].tile = -1;
+                continue;
+            }
+            queue_count--;
+        }
+
+        fds[0] = {listener, POLLIN, 0};
+        for (u32 i = 0; i < workers_count; i++) fds[i + 1] = {workers[i].socket, POLLIN, 0};
+
+        int ready = poll (fds, workers_count + 1, FARM_IDLE_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready == 0 && workers_count == 0)
+        {
+            fprintf (stderr, "No workers connected to %s\n", path);
+            break;
+        }
+
+        // Walk backwards so a lost worker can be replaced by the last one
+        for (s32 i = workers_count - 1; i >= 0; i--)
+        {
+            if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            FarmWorker *worker = &workers[i];
+            FarmResult result;
+            FarmTile tile = {};
+            // Anything but the whole tile that was handed out counts as a lost worker
+            bool ok = read_all (worker->socket, &result, sizeof (result)) &&
+                      worker->tile >= 0 && result.index == (u32) worker->tile;
+            if (ok) tile = farm_tile (view, result.index, tiles_x);
+            ok = ok && result.count == tile.w * tile.h &&
+                 read_all (worker->socket, tile_counts, result.count * sizeof (u32));
+
+            if (ok)
+            {
+                for (u32 y = 0; y < tile.h; y++)
+                {
+                    memcpy (counts + (size_t) (tile.y + y) * view.w + tile.x,
+                            tile_counts + y * tile.w, tile.w * sizeof (u32));
+                }
+                worker->tile = -1;
+                tiles_done++;
+            }
+            else
+            {
+                if (worker->tile >= 0) queue[queue_count++] = worker->tile;
+                close (worker->socket);
+                *worker = workers[--workers_count];
+                lost_workers++;
+            }
+        }
+
+        if ((fds[0].revents & POLLIN) && workers_count < FARM_MAX_WORKERS)
+        {
+            int fd = accept (listener, 0, 0);
+            if (fd >= 0) workers[workers_count++] = {fd, -1};
+        }
+    }
+
+    for (u32 i = 0; i < workers_count; i++) close (workers[i].socket);
+    close (listener);
+    unlink (path);
+    while (wait (0) > 0) {}
+
+    if (lost_workers) fprintf (stderr, "Lost %u workers, their tiles were re-queued\n", lost_workers);
+
+    free (queue);
+    free (tile_counts);
+    return tiles_done == tiles_count;
+}
@@ -30,14 +30,27 @@
 #include <math.h>
 #include <string.h>
 
+#ifdef OS_GNULINUX
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
 typedef float    r32;
 typedef double   r64;
 
+typedef uint64_t u64;
 typedef uint32_t u32;
 typedef uint16_t u16;
 typedef uint8_t  u8;
 typedef int16_t s16;
 typedef int32_t s32;
+typedef int64_t s64;
 
 
 enum InputType {
@@ -60,6 +73,8 @@ enum InputType {
     INPUT_COLOR_3,
     INPUT_RESET_COLORS,
     INPUT_TOTAL_RESET,
+    INPUT_SCREENSHOT,
+    INPUT_COUNT,
 };
 
 
@@ -92,6 +107,20 @@ to_color (u32 hex_color)
 
 #include "figures_colors.cpp"
 #include "text.cpp"
+#include "replay.cpp"
+#include "double_double.cpp"
+#include "iterations.cpp"
+#include "pixel_state.cpp"
+#include "export.cpp"
+#include "atlas.cpp"
+#ifdef OS_GNULINUX
+#include "farm.cpp"
+#include "server.cpp"
+#endif
+
+
+// Set by --headless: no window, no GL, no frame delay
+static bool headless = false;
 
 
 static void
@@ -124,6 +153,8 @@ new_image (u32 w, u32 h, int x, int y)
     image.h = h;
     image.pixels = (V3 *) malloc (sizeof (V3) * image.w * image.h);
 
+    if (headless) return image;
+
     glGenTextures (1, &image.texture);
     glBindTexture (GL_TEXTURE_2D, image.texture);
     glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -174,8 +205,8 @@ show_image (Image image)
 
 static void
 redraw (Image image1, Image image2,
-        V2 *coordinates, u32& s,
-        s32 shift_x, s32 shift_y,
+        PixelState& state, u32& s,
+        DD center_x, DD center_y,
         r64 scale, r64 R,
         V3 color_scheme,  bool& freeze_flag)
 {
@@ -183,41 +214,267 @@ redraw (Image image1, Image image2,
     freeze_flag = false;
     draw_rectangle (image2, 86, 19, 62, 18, 0xffffff);
     uniform_fill (image1, 0x000000);
-    r64 x_step = 1.0/(image1.w* scale);
-    r64 y_step = 1.0/(image1.h* scale);
+    reset_pixel_state (state, image1, center_x, center_y, scale, R, color_scheme);
+}
+
+
+
+
+int
+main (int argc, char **argv)
+{
+    r64 constant_pool[14][2] = {{0.285, 0.01},{0.28, 0.0113},{0.285, 0},
+                                {0.45, 0.1428}, {-0.0085, 0.71},{-0.1, 0.651},
+                                {-0.382, 0.618},{-0.618, 0},{-0.74543, 0.11301},
+                                {- 0.8, 0.156},{-0.70176, -0.3842}, {-0.835, -0.2321},
+                                { -0.7269, 0.1889}, {0, -0.8}};
 
-    for (u32 y = 0; y < image1.h; y++)
+    //**********OPTIONS**********
+    //  --record FILE    save the input stream to FILE
+    //  --replay FILE    play back the input stream from FILE and report frame timings
+    //  --headless       replay without a window and without frame delays
+    //  --no-delay       ignore the speed setting during replay
+    //  --timings FILE   write per-frame timings of a replay to FILE
+    //  --float          iterate shallow views in r32, half the memory traffic
+    //  --farm FILE      render the view below with worker processes, save iteration counts to FILE
+    //  --workers N      number of workers the farm forks itself (default 4, 0 = external only)
+    //  --socket PATH    Unix socket of the farm (default /tmp/fractals-farm.sock)
+    //  --worker PATH    serve tiles to the farm listening on PATH
+    //  (--farm, --workers, --socket, --worker and --serve are Linux only)
+    //  --serve PATH     run the render job server on a Unix socket, or on stdin/stdout if PATH is -
+    //  view of --farm: --constant X Y, --scale S, --center X Y, --size W H, --iterations N
+    //  --atlas FILE     save a grid of Julia sets for all constants of the pool, index in FILE.index
+    //  --atlas-sweep N  use N x N constants over the Mandelbrot set instead of the pool
+    //  --cell N         atlas cell size in pixels (default 96)
+    //  --bench-state W H FRAMES  time FRAMES window frames on a W x H view (of --farm) without a window
+    Playback playback = {};
+    const char *timings_filename = 0;
+    bool no_delay = false;
+    bool use_float = false;
+#ifdef OS_GNULINUX
+    const char *farm_filename = 0;
+    const char *farm_socket = "/tmp/fractals-farm.sock";
+    const char *worker_socket = 0;
+    u32 farm_workers = 4;
+    const char *server_socket = 0;
+#endif
+    const char *atlas_filename = 0;
+    u32 atlas_sweep = 0;
+    u32 atlas_cell = 96;
+    u32 bench_frames = 0;
+
+    View view = {};
+    view.constant_x = 0.285;
+    view.constant_y = 0.01;
+    view.scale = 0.25;
+    view.w = 760;
+    view.h = 760;
+    view.max_iterations = 1000;
+
+    for (int i = 1; i < argc; i++)
     {
-        for (u32 x = 0; x < image1.w; x++)
-        {
-            coordinates[y * image1.w + x].xn = (r64) ((s32) x - shift_x) * x_step;
-            coordinates[y * image1.w + x].yn = (r64) ((s32) y - shift_y) * y_step;
-            if (coordinates[y * image1.w + x].xn *
-                    coordinates[y * image1.w + x].xn +
-                    coordinates[y * image1.w + x].yn *
-                    coordinates[y * image1.w + x].yn > R)
+        if (strcmp (argv[i], "--record") == 0 && i + 1 < argc)
+        {
+            if (!start_recording (&playback, argv[++i])) return 1;
+        }
+        else if (strcmp (argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            if (!load_replay (&playback, argv[++i])) return 1;
+        }
+        else if (strcmp (argv[i], "--timings") == 0 && i + 1 < argc) timings_filename = argv[++i];
+        else if (strcmp (argv[i], "--headless") == 0) headless = true;
+        else if (strcmp (argv[i], "--no-delay") == 0) no_delay = true;
+        else if (strcmp (argv[i], "--float") == 0) use_float = true;
+#ifdef OS_GNULINUX
+        else if (strcmp (argv[i], "--farm") == 0 && i + 1 < argc) farm_filename = argv[++i];
+        else if (strcmp (argv[i], "--workers") == 0 && i + 1 < argc) farm_workers = atoi (argv[++i]);
+        else if (strcmp (argv[i], "--socket") == 0 && i + 1 < argc) farm_socket = argv[++i];
+        else if (strcmp (argv[i], "--worker") == 0 && i + 1 < argc) worker_socket = argv[++i];
+        else if (strcmp (argv[i], "--serve") == 0 && i + 1 < argc) server_socket = argv[++i];
+#else
+        else if (strcmp (argv[i], "--farm") == 0 || strcmp (argv[i], "--workers") == 0 ||
+                 strcmp (argv[i], "--socket") == 0 || strcmp (argv[i], "--worker") == 0 ||
+                 strcmp (argv[i], "--serve") == 0)
+        {
+            fprintf (stderr, "%s is only supported on Linux\n", argv[i]);
+            return 1;
+        }
+#endif
+        else if (strcmp (argv[i], "--constant") == 0 && i + 2 < argc)
+        {
+            view.constant_x = atof (argv[++i]);
+            view.constant_y = atof (argv[++i]);
+        }
+        else if (strcmp (argv[i], "--scale") == 0 && i + 1 < argc) view.scale = atof (argv[++i]);
+        else if (strcmp (argv[i], "--center") == 0 && i + 2 < argc)
+        {
+            if (!dd_from_string (argv[i + 1], &view.center_x) || !dd_from_string (argv[i + 2], &view.center_y))
             {
-                image1.pixels[y * image1.w + x] = color_scheme;
+                fprintf (stderr, "Bad center %s %s\n", argv[i + 1], argv[i + 2]);
+                return 1;
             }
+            i += 2;
+        }
+        else if (strcmp (argv[i], "--size") == 0 && i + 2 < argc)
+        {
+            s32 w = atoi (argv[i + 1]);
+            s32 h = atoi (argv[i + 2]);
+            if (w <= 0 || h <= 0)
+            {
+                fprintf (stderr, "Bad size %s %s\n", argv[i + 1], argv[i + 2]);
+                return 1;
+            }
+            view.w = w;
+            view.h = h;
+            i += 2;
+        }
+        else if (strcmp (argv[i], "--iterations") == 0 && i + 1 < argc)
+        {
+            s32 iterations = atoi (argv[++i]);
+            if (iterations <= 0)
+            {
+                fprintf (stderr, "Bad iteration count %s\n", argv[i]);
+                return 1;
+            }
+            view.max_iterations = iterations;
+        }
+        else if (strcmp (argv[i], "--atlas") == 0 && i + 1 < argc) atlas_filename = argv[++i];
+        else if (strcmp (argv[i], "--atlas-sweep") == 0 && i + 1 < argc) atlas_sweep = atoi (argv[++i]);
+        else if (strcmp (argv[i], "--bench-state") == 0 && i + 3 < argc)
+        {
+            s32 w = atoi (argv[i + 1]);
+            s32 h = atoi (argv[i + 2]);
+            s32 frames = atoi (argv[i + 3]);
+            if (w <= 0 || h <= 0 || frames <= 0)
+            {
+                fprintf (stderr, "Bad --bench-state %s %s %s\n", argv[i + 1], argv[i + 2], argv[i + 3]);
+                return 1;
+            }
+            view.w = w;
+            view.h = h;
+            bench_frames = frames;
+            i += 3;
+        }
+        else if (strcmp (argv[i], "--cell") == 0 && i + 1 < argc)
+        {
+            s32 cell = atoi (argv[++i]);
+            if (cell <= 0)
+            {
+                fprintf (stderr, "Bad cell size %s\n", argv[i]);
+                return 1;
+            }
+            atlas_cell = cell;
+        }
+        else
+        {
+            fprintf (stderr, "Unknown option %s\n", argv[i]);
+            return 1;
         }
     }
-}
 
+    if (bench_frames) return bench_pixel_state (view, bench_frames, use_float);
 
+    if (atlas_filename)
+    {
+        Atlas atlas = {};
+        if (atlas_sweep) render_atlas (&atlas, mandelbrot_sweep (atlas_sweep), atlas_sweep * atlas_sweep, atlas_cell, view.max_iterations);
+        else render_atlas (&atlas, &constant_pool[0][0], 14, atlas_cell, view.max_iterations);
+
+        V3 atlas_colors[60];
+        set_colors (atlas_colors, 0x0000ff, 0xffffff, 0xffa000);
+        Image image = {};
+        image.w = atlas.mosaic_w;
+        image.h = atlas.mosaic_h;
+        image.pixels = (V3 *) malloc ((size_t) image.w * image.h * sizeof (V3));
+        for (size_t i = 0; i < (size_t) image.w * image.h; i++) image.pixels[i] = iteration_color (atlas_colors, atlas.counts[i]);
+
+        Exporter exporter = {};
+        start_exporter (&exporter, image.w, image.h);
+        export_image (&exporter, image, atlas.counts, atlas_filename, export_format (atlas_filename));
+        stop_exporter (&exporter);
+        if (exporter.failures) return 1;
+
+        char index_filename[512];
+        snprintf (index_filename, sizeof (index_filename), "%s.index", atlas_filename);
+        if (!write_atlas_index (&atlas, index_filename))
+        {
+            fprintf (stderr, "Can't write %s\n", index_filename);
+            return 1;
+        }
+        return 0;
+    }
 
+#ifdef OS_GNULINUX
+    if (worker_socket) return run_farm_worker (worker_socket);
+    if (server_socket) return run_server (server_socket);
 
-int
-main (int argc, char **argv)
-{
-    //**********SETUP**********
-    SDL_Init (SDL_INIT_VIDEO);
-    SDL_Window *main_window = SDL_CreateWindow ("Graphics", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-                                                MAIN_WINDOW_INIT_WIDTH, MAIN_WINDOW_INIT_HEIGHT, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
-    assert (main_window);
-    SDL_GLContext glcontext = SDL_GL_CreateContext (main_window);
-    assert (glcontext);
+    if (farm_filename)
+    {
+        u32 *counts = (u32 *) malloc ((size_t) view.w * view.h * sizeof (u32));
+        if (!counts)
+        {
+            fprintf (stderr, "Can't allocate %ux%u counts\n", view.w, view.h);
+            return 1;
+        }
+        if (!run_farm (view, farm_socket, farm_workers, counts)) return 1;
 
-    set_window_transform (MAIN_WINDOW_INIT_WIDTH, MAIN_WINDOW_INIT_HEIGHT);
+        size_t length = strlen (farm_filename);
+        if (length >= 4 && (strcmp (farm_filename + length - 4, ".png") == 0 ||
+                            strcmp (farm_filename + length - 4, ".ppm") == 0))
+        {
+            // Colored like the window, with the counts next to it in FILE.counts
+            V3 farm_colors[60];
+            set_colors (farm_colors, 0x0000ff, 0xffffff, 0xffa000);
+            Image image = {};
+            image.w = view.w;
+            image.h = view.h;
+            image.pixels = (V3 *) malloc ((size_t) view.w * view.h * sizeof (V3));
+            for (size_t i = 0; i < (size_t) view.w * view.h; i++) image.pixels[i] = iteration_color (farm_colors, counts[i]);
+
+            Exporter exporter = {};
+            start_exporter (&exporter, view.w, view.h);
+            export_image (&exporter, image, counts, farm_filename, export_format (farm_filename));
+            stop_exporter (&exporter);
+            return exporter.failures ? 1 : 0;
+        }
+
+        // Top row first, like FILE.counts next to a picture
+        FILE *file = fopen (farm_filename, "wb");
+        bool written = file != 0;
+        for (u32 y = view.h; written && y-- > 0;)
+        {
+            written = fwrite (counts + (size_t) y * view.w, sizeof (u32), view.w, file) == view.w;
+        }
+        if (file && fclose (file) != 0) written = false;
+        if (!written)
+        {
+            fprintf (stderr, "Can't write %s\n", farm_filename);
+            return 1;
+        }
+        return 0;
+    }
+#endif
+
+    if (headless && playback.mode != PLAYBACK_REPLAY)
+    {
+        fprintf (stderr, "--headless needs --replay\n");
+        return 1;
+    }
+    if (headless) no_delay = true;
+
+    //**********SETUP**********
+    SDL_Window *main_window = 0;
+    if (!headless)
+    {
+        SDL_Init (SDL_INIT_VIDEO);
+        main_window = SDL_CreateWindow ("Graphics", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+                                        MAIN_WINDOW_INIT_WIDTH, MAIN_WINDOW_INIT_HEIGHT, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
+        assert (main_window);
+        SDL_GLContext glcontext = SDL_GL_CreateContext (main_window);
+        assert (glcontext);
+
+        set_window_transform (MAIN_WINDOW_INIT_WIDTH, MAIN_WINDOW_INIT_HEIGHT);
+    }
 
     size_t points_max = 1024;
 
@@ -231,8 +488,11 @@ main (int argc, char **argv)
         new_image (320, 40,    380,  -380),
     };
 
-    glEnable (GL_TEXTURE_2D);
-    glClearColor (0.20, 0.25, 0.30, 1.0);
+    if (!headless)
+    {
+        glEnable (GL_TEXTURE_2D);
+        glClearColor (0.20, 0.25, 0.30, 1.0);
+    }
 
     int window_w = MAIN_WINDOW_INIT_WIDTH;
     int window_h = MAIN_WINDOW_INIT_WIDTH;
@@ -255,43 +515,46 @@ main (int argc, char **argv)
         draw_square (images[3], 45 + 40*i, 20, 30, hex_color[i]);
     }
 
-    r64 constant_pool[14][2] = {{0.285, 0.01},{0.28, 0.0113},{0.285, 0},
-                                {0.45, 0.1428}, {-0.0085, 0.71},{-0.1, 0.651},
-                                {-0.382, 0.618},{-0.618, 0},{-0.74543, 0.11301},
-                                {- 0.8, 0.156},{-0.70176, -0.3842}, {-0.835, -0.2321},
-                                { -0.7269, 0.1889}, {0, -0.8}};
     u32 constant_pool_num = 0;
 
     r64 constant_x = constant_pool[constant_pool_num][0];
     r64 constant_y = constant_pool[constant_pool_num][1];
     r32 scale = 0.25;
-    s32 shift_x = images[0].w/2;
-    s32 shift_y = images[0].h/2;
-    s32 image_w = images[0].w;
-    s32 image_h = images[0].h;
-    r64 R = 2 + sqrt (1 + 4* sqrt (constant_x*constant_x + constant_y*constant_y));
+    DD center_x = {0, 0};
+    DD center_y = {0, 0};
+    r64 R = escape_radius (constant_x, constant_y);
     u32 frame_time = 0;
     bool freeze_flag;
 
-    V2 *coordinates = (V2 *) malloc (images[0].w*images[0].h * sizeof (V2));
+    Exporter exporter = {};
+    start_exporter (&exporter, images[0].w, images[0].h);
+    u32 screenshot_num = 0;
 
-    redraw (images[0], images[2], coordinates, constant_pool_num, shift_x, shift_y, scale, R, color_scheme[0], freeze_flag);
+    PixelState state = new_pixel_state (images[0].w*images[0].h, use_float);
+    redraw (images[0], images[2], state, constant_pool_num, center_x, center_y, scale, R, color_scheme[0], freeze_flag);
 
 
 
     draw_double (images[2], constant_x, 166, 13);
     draw_double (images[2], constant_y, 251, 13);
-    draw_double (images[2], coordinates[0].xn, 375, 13);
-    draw_double (images[2], coordinates[images[0].w - 1].xn + 1.0/(images[0].w* scale), 468, 13);
-    draw_double (images[2], coordinates[0].yn, 589, 13);
-    draw_double (images[2], coordinates[images[0].w * images[0].h - 1].yn + 1.0/(images[0].h* scale), 683, 13);
+    draw_double (images[2], pixel_coordinate (center_x, 0, images[0].w, scale).hi, 375, 13);
+    draw_double (images[2], pixel_coordinate (center_x, images[0].w, images[0].w, scale).hi, 468, 13);
+    draw_double (images[2], pixel_coordinate (center_y, 0, images[0].h, scale).hi, 589, 13);
+    draw_double (images[2], pixel_coordinate (center_y, images[0].h, images[0].h, scale).hi, 683, 13);
     //**********DRAW**********
-    for (int keep_running = 1; keep_running; )
+    u32 frame = 0;
+    for (int keep_running = 1; keep_running; frame++)
     {
         static u32 s = 0;
         InputType input = INPUT_NONE;
 
-        for (SDL_Event event; SDL_PollEvent (&event);)
+        if (playback.mode == PLAYBACK_REPLAY)
+        {
+            if (replay_finished (&playback, frame)) break;
+            begin_frame_timing (&playback);
+        }
+
+        for (SDL_Event event; !headless && SDL_PollEvent (&event);)
         {
             switch (event.type)
             {
@@ -337,18 +600,22 @@ main (int argc, char **argv)
                     case SDLK_3:            input = INPUT_COLOR_3; break;
                     case SDLK_0:            input = INPUT_RESET_COLORS; break;
                     case SDLK_r:            input = INPUT_TOTAL_RESET; break;
+                    case SDLK_p:            input = INPUT_SCREENSHOT; break;
                     }
                 }
             } break;
             }
         }
 
+        if (playback.mode == PLAYBACK_REPLAY) input = replay_input (&playback, frame);
+        if (playback.mode == PLAYBACK_RECORD) record_input (&playback, frame, SDL_GetTicks (), input);
+
         switch (input)
         {
         case INPUT_NONE: break;
         case INPUT_REDRAW:
         {
-            redraw (images[0], images[2], coordinates, s, shift_x, shift_y, scale, R, color_scheme[0], freeze_flag);
+            redraw (images[0], images[2], state, s, center_x, center_y, scale, R, color_scheme[0], freeze_flag);
         } break;
         case INPUT_INCREASE_SPEED:
         {
@@ -369,19 +636,19 @@ main (int argc, char **argv)
         } break;
         case INPUT_SHIFT_UP:
         {
-            shift_y += images[0].h/4;
+            center_y = move_center (center_y, -(s32) images[0].h/4, images[0].h, scale);
         } break;
         case INPUT_SHIFT_DOWN:
         {
-            shift_y -= images[0].h/4;
+            center_y = move_center (center_y, images[0].h/4, images[0].h, scale);
         } break;
         case INPUT_SHIFT_LEFT:
         {
-            shift_x -= images[0].w/4;
+            center_x = move_center (center_x, images[0].w/4, images[0].w, scale);
         } break;
         case INPUT_SHIFT_RIGHT:
         {
-            shift_x += images[0].w/4;
+            center_x = move_center (center_x, -(s32) images[0].w/4, images[0].w, scale);
         } break;
         case INPUT_ZOOM_IN:
         {
@@ -394,15 +661,15 @@ main (int argc, char **argv)
         case INPUT_RESET_SCALE:
         {
             scale = 0.25;
-            shift_x = images[0].w/2;
-            shift_y = images[0].h/2;
+            center_x = {0, 0};
+            center_y = {0, 0};
         } break;
         case INPUT_CONSTANT:
         {
             constant_pool_num = (constant_pool_num +1)%14;
             constant_x = constant_pool[constant_pool_num][0];
             constant_y = constant_pool[constant_pool_num][1];
-            R = (1 + sqrt (1 + 4* sqrt (constant_x*constant_x + constant_y*constant_y))) + 1;
+            R = escape_radius (constant_x, constant_y);
         } break;
         case INPUT_COLOR_1:
         {
@@ -428,16 +695,29 @@ main (int argc, char **argv)
             hex_color[1] = 0xffffff;
             hex_color[2] = 0xffa000;
         } break;
+        case INPUT_SCREENSHOT:
+        {
+            char filename[64];
+            FILE *existing;
+            do
+            {
+                snprintf (filename, sizeof (filename), "fractal-%03u.png", ++screenshot_num);
+                existing = fopen (filename, "rb");
+                if (existing) fclose (existing);
+            } while (existing);
+            export_image (&exporter, images[0], 0, filename, EXPORT_PNG);
+        } break;
+        case INPUT_COUNT: break;
         case INPUT_TOTAL_RESET:
         {
             frame_time = 0;
             scale = 0.25;
-            shift_x = 380;
-            shift_y = 380;
+            center_x = {0, 0};
+            center_y = {0, 0};
             constant_pool_num = 0;
             constant_x = constant_pool[constant_pool_num][0];
             constant_y = constant_pool[constant_pool_num][1];
-            R = 2 + sqrt (1 + 4* sqrt (constant_x*constant_x + constant_y*constant_y));
+            R = escape_radius (constant_x, constant_y);
             hex_color[0] = 0x0000ff;
             hex_color[1] = 0xffffff;
             hex_color[2] = 0xffa000;
@@ -448,14 +728,14 @@ main (int argc, char **argv)
                 input == INPUT_ZOOM_OUT || input == INPUT_RESET_SCALE || input == INPUT_TOTAL_RESET) {
             draw_rectangle (images[2], 627, 19, 83, 21, 0xffffff);
             draw_rectangle (images[2], 720, 19, 78, 21, 0xffffff);
-            draw_double (images[2], coordinates[0].yn, 589, 13);
-            draw_double (images[2], coordinates[images[0].w * images[0].h - 1].yn + 1.0/(images[0].h* scale), 683, 13);
+            draw_double (images[2], pixel_coordinate (center_y, 0, images[0].h, scale).hi, 589, 13);
+            draw_double (images[2], pixel_coordinate (center_y, images[0].h, images[0].h, scale).hi, 683, 13);
         } if (input == INPUT_SHIFT_LEFT || input == INPUT_SHIFT_RIGHT || input == INPUT_ZOOM_IN ||
               input == INPUT_ZOOM_OUT || input == INPUT_RESET_SCALE || input == INPUT_TOTAL_RESET) {
             draw_rectangle (images[2], 411, 21, 80, 21, 0xffffff);
             draw_rectangle (images[2], 509, 21, 85, 21, 0xffffff);
-            draw_double (images[2], coordinates[0].xn, 375, 13);
-            draw_double (images[2], coordinates[images[0].w - 1].xn + 1.0/(images[0].w* scale), 468, 13);
+            draw_double (images[2], pixel_coordinate (center_x, 0, images[0].w, scale).hi, 375, 13);
+            draw_double (images[2], pixel_coordinate (center_x, images[0].w, images[0].w, scale).hi, 468, 13);
         } if (input == INPUT_CONSTANT || input == INPUT_TOTAL_RESET) {
             draw_rectangle (images[2], 197, 19, 75, 23, 0xffffff);
             draw_rectangle (images[2], 282, 22, 71, 23, 0xffffff);
@@ -469,54 +749,39 @@ main (int argc, char **argv)
         }
 
         if ((input >= INPUT_SHIFT_UP && input <= INPUT_CONSTANT) || input == INPUT_TOTAL_RESET) {
-            redraw (images[0], images[2], coordinates, s, shift_x, shift_y, scale, R, color_scheme[0], freeze_flag);
+            redraw (images[0], images[2], state, s, center_x, center_y, scale, R, color_scheme[0], freeze_flag);
         }
 
 
-        glClear (GL_COLOR_BUFFER_BIT);
-
         if (freeze_flag == false)
         {
-            V3 *pointer = images[0].pixels;
-            for (s32 y = 0; y < image_h; y++)
-            {
-                for (s32 x = 0; x < image_w; x++)
-                {
-                    if (coordinates[y*image_w+x].xn*coordinates[y*image_w+x].xn + coordinates[y*image_w+x].yn*coordinates[y*image_w+x].yn <= R)
-                    {
-                        r64 x_test = coordinates[y*image_w+x].xn;
-                        r64 y_test = coordinates[y*image_w+x].yn;
-                        coordinates[y*image_w+x].yn = 2*x_test * y_test + constant_y;
-                        coordinates[y*image_w+x].xn = x_test*x_test - y_test*y_test + constant_x;
-
-                        if (coordinates[y*image_w+x].xn*coordinates[y*image_w+x].xn + coordinates[y*image_w+x].yn*coordinates[y*image_w+x].yn > R)
-                        {
-                            u32 draw_step = s % 60;
-                            *pointer = color_scheme[draw_step];
-                        }
-                    }
-
-                    pointer++;
-                }
-            }
-
+            iterate_pixel_state (images[0], state, constant_x, constant_y, R, color_scheme[s % 60]);
 
             draw_integer(images[2], s, 106, 13);
             ++s;
         }
 
-        for (u32 i = 0; i < images_count; ++i)
-        {
-            update_image_texture (images[i]);
-            show_image           (images[i]);
-        }
+        if (playback.mode == PLAYBACK_REPLAY) end_frame_timing (&playback);
 
+        if (!headless)
+        {
+            glClear (GL_COLOR_BUFFER_BIT);
 
+            for (u32 i = 0; i < images_count; ++i)
+            {
+                update_image_texture (images[i]);
+                show_image           (images[i]);
+            }
 
-        SDL_Delay(frame_time);
-        SDL_GL_SwapWindow (main_window);
+            if (!no_delay) SDL_Delay(frame_time);
+            SDL_GL_SwapWindow (main_window);
+        }
     }
 
+    if (playback.mode == PLAYBACK_RECORD) stop_recording (&playback, frame, SDL_GetTicks ());
+    if (playback.mode == PLAYBACK_REPLAY) report_frame_timings (&playback, timings_filename);
+    stop_exporter (&exporter);
+
     return 0;
 }
 
@@ -0,0 +1,102 @@
+/* Graphics drawing program
+ *
+ * Copyright (C) 2019 Martin & Diana
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Offline escape-time rendering: the same picture the window builds frame
+// by frame, computed straight into iteration counts.
+//   count 0            - outside R before the first step (redraw() paints it)
+//   count n            - escaped on step n, i.e. in frame s = n - 1
+//   ITERATIONS_INSIDE  - still inside after max_iterations steps
+// Row y = 0 is the bottom of the view, as in the window's images; every
+// file of counts (--farm raw output, FILE.counts) is written top row first.
+
+#define ITERATIONS_INSIDE 0xffffffff
+
+
+struct View {
+    r64 constant_x, constant_y;
+    r64 scale;
+    DD center_x, center_y;
+    u32 w, h;
+    u32 max_iterations;
+};
+
+
+static r64
+escape_radius (r64 constant_x, r64 constant_y)
+{
+    return 2 + sqrt (1 + 4* sqrt (constant_x*constant_x + constant_y*constant_y));
+}
+
+
+// Same pixel mapping as redraw(), with the double-double step past DD_PIXEL_SPACING
+static void
+render_tile (View view, u32 x0, u32 y0, u32 tile_w, u32 tile_h, u32 *counts)
+{
+    r64 R = escape_radius (view.constant_x, view.constant_y);
+    bool deep = use_double_double (view.w, view.h, view.scale);
+    DD cx = {view.constant_x, 0};
+    DD cy = {view.constant_y, 0};
+
+    for (u32 y = y0; y < y0 + tile_h; y++)
+    {
+        for (u32 x = x0; x < x0 + tile_w; x++)
+        {
+            u32 count = ITERATIONS_INSIDE;
+
+            if (deep)
+            {
+                DD xn = pixel_coordinate (view.center_x, x, view.w, view.scale);
+                DD yn = pixel_coordinate (view.center_y, y, view.h, view.scale);
+                if (xn.hi*xn.hi + yn.hi*yn.hi > R) count = 0;
+                for (u32 i = 1; count == ITERATIONS_INSIDE && i <= view.max_iterations; i++)
+                {
+                    DD new_x = dd_add (dd_add (dd_mul (xn, xn), dd_neg (dd_mul (yn, yn))), cx);
+                    yn = dd_add (dd_mul_d (dd_mul (xn, yn), 2.0), cy);
+                    xn = new_x;
+                    if (xn.hi*xn.hi + yn.hi*yn.hi > R) count = i;
+                }
+            }
+            else
+            {
+                r64 xn = pixel_coordinate (view.center_x, x, view.w, view.scale).hi;
+                r64 yn = pixel_coordinate (view.center_y, y, view.h, view.scale).hi;
+                if (xn*xn + yn*yn > R) count = 0;
+                for (u32 i = 1; count == ITERATIONS_INSIDE && i <= view.max_iterations; i++)
+                {
+                    r64 x_test = xn;
+                    r64 y_test = yn;
+                    yn = 2*x_test * y_test + view.constant_y;
+                    xn = x_test*x_test - y_test*y_test + view.constant_x;
+                    if (xn*xn + yn*yn > R) count = i;
+                }
+            }
+
+            *counts++ = count;
+        }
+    }
+}
+
+
+// Color the window would show for a pixel with this count
+static V3
+iteration_color (V3 *color_scheme, u32 count)
+{
+    if (count == ITERATIONS_INSIDE) return to_color (0x000000);
+    if (count == 0) return color_scheme[0];
+    return color_scheme[(count - 1) % 60];
+}
@@ -0,0 +1,384 @@
+/* Graphics drawing program
+ *
+ * Copyright (C) 2019 Martin & Diana
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Iteration state of the window's pixels.
+// Pixels are grouped into tiles of STATE_TILE that share one word of live
+// bits. A tile keeps x and y in separate arrays, in r32 (--float, shallow
+// views), r64, or as hi and lo halves past DD_PIXEL_SPACING; all three
+// layouts use the same buffer, picked when the view is reset. A frame only
+// reads the live-bit words and the tiles that still have live pixels, so
+// pixels that escaped long ago cost nothing. Escaped pixels are set to NaN,
+// which never escapes again, so a mostly live tile runs every pixel in
+// one straight loop that the compiler vectorizes.
+
+#define STATE_TILE 64
+#define CACHE_LINE 64
+
+// From this many live pixels on, stepping the whole tile beats picking them out
+#define STATE_DENSE 32
+
+// Above this pixel spacing r32 is still far finer than a pixel
+#define FLOAT_PIXEL_SPACING 1e-4
+
+typedef u64 u64_pair __attribute__ ((vector_size (2 * sizeof (u64))));
+
+
+enum StateMode {
+    STATE_R64,
+    STATE_R32,
+    STATE_DD,
+};
+
+
+struct TileR32 {
+    r32 x[STATE_TILE];
+    r32 y[STATE_TILE];
+};
+
+
+struct TileR64 {
+    r64 x[STATE_TILE];
+    r64 y[STATE_TILE];
+};
+
+
+struct TileDD {
+    r64 x_hi[STATE_TILE];
+    r64 x_lo[STATE_TILE];
+    r64 y_hi[STATE_TILE];
+    r64 y_lo[STATE_TILE];
+};
+
+
+// Escapes of a whole-tile step as 1 or 0 in the tile's own type, since -O2
+// only vectorizes the step when the compare result is stored as a Real.
+// pairs tests for any escape by OR-ing 16 bytes at a time, as -O2 does
+// not vectorize the reduction itself.
+template <typename Real>
+union TileFlags {
+    Real escaped[STATE_TILE];
+    u64_pair pairs[STATE_TILE * sizeof (Real) / sizeof (u64_pair)];
+};
+
+
+struct PixelState {
+    void *tiles;            // TileR32, TileR64 or TileDD by mode
+    u64 *live;              // bit set while the pixel has not escaped
+    u32 count;
+    u32 tiles_count;
+    StateMode mode;
+    bool use_float;         // --float
+};
+
+
+// Never freed, like the rest of the program's buffers
+static void *
+cache_aligned_alloc (size_t size)
+{
+    uintptr_t p = (uintptr_t) malloc (size + CACHE_LINE - 1);
+    return (void *) ((p + CACHE_LINE - 1) & ~(uintptr_t) (CACHE_LINE - 1));
+}
+
+
+static PixelState
+new_pixel_state (u32 count, bool use_float)
+{
+    PixelState state = {};
+    state.count = count;
+    state.tiles_count = (count + STATE_TILE - 1) / STATE_TILE;
+    state.use_float = use_float;
+
+    // Room for the largest layout; pixels past count pad the last tile
+    state.tiles = cache_aligned_alloc ((size_t) state.tiles_count * sizeof (TileDD));
+    state.live = (u64 *) cache_aligned_alloc (state.tiles_count * sizeof (u64));
+    return state;
+}
+
+
+static StateMode
+state_mode (PixelState& state, u32 image_w, u32 image_h, r64 scale)
+{
+    u32 size = image_w > image_h ? image_w : image_h;
+    if (use_double_double (image_w, image_h, scale)) return STATE_DD;
+    if (state.use_float && 1.0 / (size * scale) > FLOAT_PIXEL_SPACING) return STATE_R32;
+    return STATE_R64;
+}
+
+
+static void
+set_pixel (PixelState& state, u32 i, DD x, DD y)
+{
+    u32 t = i / STATE_TILE;
+    u32 k = i % STATE_TILE;
+    switch (state.mode)
+    {
+    case STATE_R32:
+    {
+        TileR32 *tile = (TileR32 *) state.tiles + t;
+        tile->x[k] = (r32) x.hi;
+        tile->y[k] = (r32) y.hi;
+    } break;
+    case STATE_R64:
+    {
+        TileR64 *tile = (TileR64 *) state.tiles + t;
+        tile->x[k] = x.hi;
+        tile->y[k] = y.hi;
+    } break;
+    case STATE_DD:
+    {
+        TileDD *tile = (TileDD *) state.tiles + t;
+        tile->x_hi[k] = x.hi;
+        tile->x_lo[k] = x.lo;
+        tile->y_hi[k] = y.hi;
+        tile->y_lo[k] = y.lo;
+    } break;
+    }
+}
+
+
+// Puts every pixel of image at its starting point of the view. Pixels
+// already outside R get color, the rest are marked live.
+static void
+reset_pixel_state (PixelState& state, Image image,
+                   DD center_x, DD center_y, r64 scale, r64 R, V3 color)
+{
+    state.mode = state_mode (state, image.w, image.h, scale);
+    memset (state.live, 0, state.tiles_count * sizeof (u64));
+
+    const DD escaped = {NAN, 0};
+    for (u32 y = 0; y < image.h; y++)
+    {
+        DD yn = pixel_coordinate (center_y, y, image.h, scale);
+        for (u32 x = 0; x < image.w; x++)
+        {
+            u32 i = y * image.w + x;
+            DD xn = pixel_coordinate (center_x, x, image.w, scale);
+            if (xn.hi*xn.hi + yn.hi*yn.hi > R)
+            {
+                image.pixels[i] = color;
+                set_pixel (state, i, escaped, escaped);
+            }
+            else
+            {
+                state.live[i / STATE_TILE] |= (u64) 1 << (i % STATE_TILE);
+                set_pixel (state, i, xn, yn);
+            }
+        }
+    }
+    for (u32 i = state.count; i < state.tiles_count * STATE_TILE; i++) set_pixel (state, i, escaped, escaped);
+}
+
+
+// The z = z^2 + c step of pixel k; true when it escapes
+template <typename Tile, typename Real>
+static inline bool
+iterate_pixel (Tile *tile, u32 k, Real constant_x, Real constant_y, Real R)
+{
+    Real x_test = tile->x[k];
+    Real y_test = tile->y[k];
+    tile->y[k] = 2*x_test * y_test + constant_y;
+    tile->x[k] = x_test*x_test - y_test*y_test + constant_x;
+    return tile->x[k]*tile->x[k] + tile->y[k]*tile->y[k] > R;
+}
+
+
+// Same step in double-double; escape is tested on the high halves only
+static inline bool
+iterate_pixel (TileDD *tile, u32 k, r64 constant_x, r64 constant_y, r64 R)
+{
+    DD x = {tile->x_hi[k], tile->x_lo[k]};
+    DD y = {tile->y_hi[k], tile->y_lo[k]};
+
+    DD new_x = dd_add (dd_add (dd_mul (x, x), dd_neg (dd_mul (y, y))), {constant_x, 0});
+    DD new_y = dd_add (dd_mul_d (dd_mul (x, y), 2.0), {constant_y, 0});
+
+    tile->x_hi[k] = new_x.hi;
+    tile->x_lo[k] = new_x.lo;
+    tile->y_hi[k] = new_y.hi;
+    tile->y_lo[k] = new_y.lo;
+    return new_x.hi*new_x.hi + new_y.hi*new_y.hi > R;
+}
+
+
+template <typename Tile>
+static inline void
+kill_pixel (Tile *tile, u32 k)
+{
+    tile->x[k] = NAN;
+    tile->y[k] = NAN;
+}
+
+
+static inline void
+kill_pixel (TileDD *tile, u32 k)
+{
+    tile->x_hi[k] = NAN;
+    tile->y_hi[k] = NAN;
+}
+
+
+template <typename Tile, typename Real>
+static void
+iterate_live_tiles (Image image, PixelState& state,
+                    Real constant_x, Real constant_y, Real R, V3 color)
+{
+    Tile *tiles = (Tile *) state.tiles;
+    for (u32 t = 0; t < state.tiles_count; t++)
+    {
+        u64 live = state.live[t];
+        if (live == 0) continue;
+
+        Tile *tile = &tiles[t];
+        u64 escaped = 0;
+
+        if (__builtin_popcountll (live) >= STATE_DENSE)
+        {
+            TileFlags<Real> flags;
+            for (u32 k = 0; k < STATE_TILE; k++)
+            {
+                flags.escaped[k] = iterate_pixel (tile, k, constant_x, constant_y, R) ? 1 : 0;
+            }
+
+            u64_pair any = {};
+            for (u32 p = 0; p < sizeof (flags.pairs) / sizeof (u64_pair); p++) any |= flags.pairs[p];
+            if (any[0] | any[1])
+            {
+                for (u32 k = 0; k < STATE_TILE; k++) escaped |= (u64) (flags.escaped[k] != 0) << k;
+                escaped &= live;
+            }
+        }
+        else
+        {
+            for (u64 rest = live; rest; rest &= rest - 1)
+            {
+                u32 k = __builtin_ctzll (rest);
+                escaped |= (u64) iterate_pixel (tile, k, constant_x, constant_y, R) << k;
+            }
+        }
+
+        for (u64 rest = escaped; rest; rest &= rest - 1)
+        {
+            u32 k = __builtin_ctzll (rest);
+            image.pixels[t * STATE_TILE + k] = color;
+            kill_pixel (tile, k);
+        }
+        state.live[t] = live & ~escaped;
+    }
+}
+
+
+static void
+iterate_pixel_state (Image image, PixelState& state,
+                     r64 constant_x, r64 constant_y, r64 R, V3 color)
+{
+    switch (state.mode)
+    {
+    case STATE_R32:
+        iterate_live_tiles<TileR32, r32> (image, state, (r32) constant_x, (r32) constant_y, (r32) R, color);
+        break;
+    case STATE_R64:
+        iterate_live_tiles<TileR64, r64> (image, state, constant_x, constant_y, R, color);
+        break;
+    case STATE_DD:
+        iterate_live_tiles<TileDD, r64> (image, state, constant_x, constant_y, R, color);
+        break;
+    }
+}
+
+
+// Lines of a tile's array of element_size entries that hold a live pixel
+static u32
+live_lines (u64 live, u32 element_size)
+{
+    u32 per_line = CACHE_LINE / element_size;
+    u64 line_mask = per_line < 64 ? ((u64) 1 << per_line) - 1 : ~(u64) 0;
+    u32 lines = 0;
+    for (u32 k = 0; k < STATE_TILE; k += per_line)
+    {
+        if ((live >> k) & line_mask) lines++;
+    }
+    return lines;
+}
+
+
+// --bench-state: the window's frames on a view of any size without a
+// window. Prints the time per frame and the memory traffic per
+// pixel-iteration, counted in cache lines read and written back, for
+// these tiles, for tiles of interleaved x, y pairs, and for a loop that
+// reads every pixel's r64 V2 each frame and writes back the lines holding
+// live pixels, whatever the state mode.
+static int
+bench_pixel_state (View view, u32 frames, bool use_float)
+{
+    Image image = {};
+    image.w = view.w;
+    image.h = view.h;
+    image.pixels = (V3 *) malloc ((size_t) view.w * view.h * sizeof (V3));
+
+    V3 colors[60];
+    set_colors (colors, 0x0000ff, 0xffffff, 0xffa000);
+    r64 R = escape_radius (view.constant_x, view.constant_y);
+
+    PixelState state = new_pixel_state (view.w * view.h, use_float);
+    reset_pixel_state (state, image, view.center_x, view.center_y, view.scale, R, colors[0]);
+
+    u32 arrays = state.mode == STATE_DD ? 4 : 2;
+    u32 element_size = state.mode == STATE_R32 ? sizeof (r32) : sizeof (r64);
+    u32 pixel_size = arrays * element_size;
+    const char *mode_names[] = {"r64", "r32", "double-double"};
+
+    u64 iterations = 0;
+    u64 tile_bytes = 0;
+    u64 pair_bytes = 0;
+    u64 scan_bytes = 0;
+    u64 ticks = 0;
+    for (u32 frame = 0; frame < frames; frame++)
+    {
+        for (u32 t = 0; t < state.tiles_count; t++)
+        {
+            u64 live = state.live[t];
+            u32 live_count = __builtin_popcountll (live);
+            iterations += live_count;
+
+            tile_bytes += 2 * sizeof (u64);
+            pair_bytes += 2 * sizeof (u64);
+            scan_bytes += STATE_TILE * sizeof (V2);
+            if (live == 0) continue;
+
+            u32 lines = live_count >= STATE_DENSE ? STATE_TILE * element_size / CACHE_LINE : live_lines (live, element_size);
+            tile_bytes += 2 * CACHE_LINE * lines * arrays;
+            pair_bytes += 2 * CACHE_LINE * live_lines (live, pixel_size);
+            scan_bytes += CACHE_LINE * live_lines (live, sizeof (V2));
+        }
+
+        u64 start = SDL_GetPerformanceCounter ();
+        iterate_pixel_state (image, state, view.constant_x, view.constant_y, R, colors[(frame + 1) % 60]);
+        ticks += SDL_GetPerformanceCounter () - start;
+    }
+
+    r64 ms = 1000.0 * ticks / SDL_GetPerformanceFrequency ();
+    printf ("%ux%u, %s state, %u frames: %.3f ms per frame, %llu pixel-iterations\n",
+            view.w, view.h, mode_names[state.mode], frames, frames ? ms / frames : 0,
+            (unsigned long long) iterations);
+    if (iterations)
+    {
+        printf ("bytes per pixel-iteration: %.2f split tiles, %.2f interleaved tiles, %.2f scanning every pixel\n",
+                (r64) tile_bytes / iterations, (r64) pair_bytes / iterations, (r64) scan_bytes / iterations);
+    }
+    return 0;
+}
@@ -0,0 +1,243 @@
+/* Graphics drawing program
+ *
+ * Copyright (C) 2019 Martin & Diana
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Input recording and replay.
+// A recording is a text file with one line per frame that had an input:
+//     <frame> <ticks> <INPUT_NAME>
+// and a closing line "<frame> <ticks> END" that marks the session length.
+// Inputs are stored by name so recordings stay valid across builds.
+
+
+enum PlaybackMode {
+    PLAYBACK_NONE,
+    PLAYBACK_RECORD,
+    PLAYBACK_REPLAY,
+};
+
+
+struct InputEvent {
+    u32 frame;
+    u32 ticks;
+    InputType input;
+};
+
+
+struct Playback {
+    PlaybackMode mode;
+    FILE *file;
+
+    InputEvent *events;
+    u32 events_count;
+    u32 events_max;
+    u32 cursor;
+    u32 frames_total;
+
+    r64 *frame_ms;
+    u32 frames_count;
+    u32 frames_max;
+    u64 frame_start;
+};
+
+
+static const char *input_names[INPUT_COUNT] = {
+    "NONE",
+    "REDRAW",
+    "INCREASE_SPEED",
+    "DECREASE_SPEED",
+    "RESET_SPEED",
+    "FREEZE_UNFREEZE",
+    "SHIFT_UP",
+    "SHIFT_DOWN",
+    "SHIFT_LEFT",
+    "SHIFT_RIGHT",
+    "ZOOM_IN",
+    "ZOOM_OUT",
+    "RESET_SCALE",
+    "CONSTANT",
+    "COLOR_1",
+    "COLOR_2",
+    "COLOR_3",
+    "RESET_COLORS",
+    "TOTAL_RESET",
+    "SCREENSHOT",
+};
+
+
+static bool
+start_recording (Playback *playback, const char *filename)
+{
+    playback->mode = PLAYBACK_RECORD;
+    playback->file = fopen (filename, "w");
+    if (!playback->file)
+    {
+        fprintf (stderr, "Can't open %s for recording\n", filename);
+        return false;
+    }
+    return true;
+}
+
+
+static void
+record_input (Playback *playback, u32 frame, u32 ticks, InputType input)
+{
+    if (input == INPUT_NONE) return;
+    fprintf (playback->file, "%u %u %s\n", frame, ticks, input_names[input]);
+}
+
+
+static void
+stop_recording (Playback *playback, u32 frame, u32 ticks)
+{
+    fprintf (playback->file, "%u %u END\n", frame, ticks);
+    fclose (playback->file);
+    playback->file = 0;
+}
+
+
+static bool
+load_replay (Playback *playback, const char *filename)
+{
+    playback->mode = PLAYBACK_REPLAY;
+    FILE *file = fopen (filename, "r");
+    if (!file)
+    {
+        fprintf (stderr, "Can't open %s for replay\n", filename);
+        return false;
+    }
+
+    playback->events_max = 64;
+    playback->events = (InputEvent *) malloc (playback->events_max * sizeof (InputEvent));
+
+    u32 frame, ticks;
+    char name[32];
+    bool ended = false;
+    while (!ended && fscanf (file, "%u %u %31s", &frame, &ticks, name) == 3)
+    {
+        if (strcmp (name, "END") == 0)
+        {
+            playback->frames_total = frame;
+            ended = true;
+            break;
+        }
+
+        u32 input = 0;
+        while (input < INPUT_COUNT && strcmp (name, input_names[input]) != 0) input++;
+        if (input == INPUT_COUNT)
+        {
+            fprintf (stderr, "%s: unknown input %s at frame %u\n", filename, name, frame);
+            continue;
+        }
+
+        if (playback->events_count == playback->events_max)
+        {
+            playback->events_max *= 2;
+            playback->events = (InputEvent *) realloc (playback->events, playback->events_max * sizeof (InputEvent));
+        }
+        playback->events[playback->events_count++] = {frame, ticks, (InputType) input};
+    }
+    fclose (file);
+
+    // A recording cut short (crash, kill) still replays up to its last input
+    if (!ended)
+    {
+        playback->frames_total = playback->events_count ?
+            playback->events[playback->events_count - 1].frame + 1 : 0;
+    }
+    return true;
+}
+
+
+static InputType
+replay_input (Playback *playback, u32 frame)
+{
+    if (playback->cursor < playback->events_count &&
+            playback->events[playback->cursor].frame == frame)
+    {
+        return playback->events[playback->cursor++].input;
+    }
+    return INPUT_NONE;
+}
+
+
+static bool
+replay_finished (Playback *playback, u32 frame)
+{
+    return frame >= playback->frames_total;
+}
+
+
+static void
+begin_frame_timing (Playback *playback)
+{
+    playback->frame_start = SDL_GetPerformanceCounter ();
+}
+
+
+static void
+end_frame_timing (Playback *playback)
+{
+    u64 elapsed = SDL_GetPerformanceCounter () - playback->frame_start;
+    if (playback->frames_count == playback->frames_max)
+    {
+        playback->frames_max = playback->frames_max ? playback->frames_max * 2 : 1024;
+        playback->frame_ms = (r64 *) realloc (playback->frame_ms, playback->frames_max * sizeof (r64));
+    }
+    playback->frame_ms[playback->frames_count++] = 1000.0 * elapsed / SDL_GetPerformanceFrequency ();
+}
+
+
+static int
+compare_r64 (const void *a, const void *b)
+{
+    r64 x = *(const r64 *) a;
+    r64 y = *(const r64 *) b;
+    return (x > y) - (x < y);
+}
+
+
+// Prints a timing summary to stdout and, if filename is given,
+// writes the per-frame times (in milliseconds) one per line.
+static void
+report_frame_timings (Playback *playback, const char *filename)
+{
+    u32 n = playback->frames_count;
+    if (n == 0) return;
+
+    if (filename)
+    {
+        FILE *file = fopen (filename, "w");
+        if (file)
+        {
+            fprintf (file, "frame ms\n");
+            for (u32 i = 0; i < n; i++) fprintf (file, "%u %.4f\n", i, playback->frame_ms[i]);
+            fclose (file);
+        }
+        else fprintf (stderr, "Can't open %s for timings\n", filename);
+    }
+
+    r64 total = 0;
+    for (u32 i = 0; i < n; i++) total += playback->frame_ms[i];
+
+    r64 *sorted = (r64 *) malloc (n * sizeof (r64));
+    memcpy (sorted, playback->frame_ms, n * sizeof (r64));
+    qsort (sorted, n, sizeof (r64), compare_r64);
+
+    printf ("frames %u  total %.2f ms  mean %.4f ms  min %.4f  median %.4f  p95 %.4f  max %.4f\n",
+            n, total, total / n, sorted[0], sorted[n / 2], sorted[(u32) (0.95 * (n - 1))], sorted[n - 1]);
+    free (sorted);
+}
@@ -0,0 +1,592 @@
+/* Graphics drawing program
+ *
+ * Copyright (C) 2019 Martin & Diana
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Render job server.
+// Requests come one per line, from stdin or from clients of a Unix socket:
+//     <id> <priority> <cx> <cy> <scale> <center_x> <center_y> <w> <h> <iterations> <color1> <color2> <color3> <output>
+// with the same meaning as the window's constant, scale, view center and
+// set_colors() (colors as hex, e.g. 0000ff). The center is read to
+// double-double precision for deep views. priority is a signed integer,
+// higher runs first and equal priorities run in arrival order; a request
+// that joins a queued job raises it to the higher of the two priorities.
+// The picture goes to output, PNG or PPM by extension, and the reply line is
+//     <id> ok <key> rendered|merged|cached <output>     or     <id> error <reason>
+// Results are cached as iteration counts under a hash of the view, so the
+// palette is applied at delivery and a new palette is a cache hit too.
+// A request for a view that is already queued or rendering joins that job.
+// The hash only finds candidates; cache hits and merges compare the whole view.
+
+#define SERVER_THREADS 4
+#define SERVER_CACHE_BYTES ((size_t) 256 << 20)
+#define SERVER_CACHE_SLOTS 256
+#define SERVER_MAX_PIXELS ((size_t) 64 << 20)
+
+
+struct ServerClient {
+    int fd;
+    SDL_mutex *write_mutex;
+    u32 references;     // guarded by Server.mutex
+};
+
+
+struct ServerWaiter {
+    ServerClient *client;
+    char id[32];
+    u32 palette[3];
+    char output[256];
+    const char *status;
+    ServerWaiter *next;
+};
+
+
+struct CacheEntry {
+    u64 key;
+    View view;
+    u32 *counts;
+    size_t bytes;
+    u32 last_used;
+    u32 users;          // deliveries reading counts, entry can't be evicted
+                        // a slot with no counts is free
+};
+
+
+struct ServerJob {
+    u64 key;
+    View view;
+    s32 priority;
+    u32 sequence;
+    bool running;
+    CacheEntry *entry;  // set for cache hits
+    ServerWaiter *waiters;
+    ServerJob *next;
+};
+
+
+struct Server {
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    ServerJob *jobs;        // queued and running renders
+    ServerJob *deliveries;  // cache hits waiting to be written
+    u32 busy;
+    u32 sequence;
+    bool quit;
+
+    CacheEntry cache[SERVER_CACHE_SLOTS];
+    size_t cache_bytes;
+    u32 clock;
+
+    SDL_Thread *threads[SERVER_THREADS];
+};
+
+
+struct ServerThread {
+    Server *server;
+    Exporter scratch;
+    ExportJob output;
+    V3 palette[60];
+};
+
+
+static u64
+hash_bytes (u64 hash, const void *data, size_t size)
+{
+    const u8 *bytes = (const u8 *) data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+
+// FNV-1a over the fields that change the counts, one by one to skip padding
+static u64
+view_key (View view)
+{
+    u64 hash = 0xcbf29ce484222325ull;
+    hash = hash_bytes (hash, &view.constant_x, sizeof (view.constant_x));
+    hash = hash_bytes (hash, &view.constant_y, sizeof (view.constant_y));
+    hash = hash_bytes (hash, &view.scale, sizeof (view.scale));
+    hash = hash_bytes (hash, &view.center_x.hi, sizeof (view.center_x.hi));
+    hash = hash_bytes (hash, &view.center_x.lo, sizeof (view.center_x.lo));
+    hash = hash_bytes (hash, &view.center_y.hi, sizeof (view.center_y.hi));
+    hash = hash_bytes (hash, &view.center_y.lo, sizeof (view.center_y.lo));
+    hash = hash_bytes (hash, &view.w, sizeof (view.w));
+    hash = hash_bytes (hash, &view.h, sizeof (view.h));
+    hash = hash_bytes (hash, &view.max_iterations, sizeof (view.max_iterations));
+    return hash;
+}
+
+
+static bool
+views_equal (View a, View b)
+{
+    return a.constant_x == b.constant_x && a.constant_y == b.constant_y &&
+           a.scale == b.scale &&
+           a.center_x.hi == b.center_x.hi && a.center_x.lo == b.center_x.lo &&
+           a.center_y.hi == b.center_y.hi && a.center_y.lo == b.center_y.lo &&
+           a.w == b.w && a.h == b.h && a.max_iterations == b.max_iterations;
+}
+
+
+static void
+reply (ServerClient *client, const char *line)
+{
+    SDL_LockMutex (client->write_mutex);
+    write_all (client->fd, line, strlen (line));
+    SDL_UnlockMutex (client->write_mutex);
+}
+
+
+// Call with server->mutex held
+static void
+release_client (ServerClient *client)
+{
+    if (--client->references > 0) return;
+    if (client->fd > 2) close (client->fd);
+    SDL_DestroyMutex (client->write_mutex);
+    free (client);
+}
+
+
+// Call with server->mutex held
+static CacheEntry *
+find_cache_entry (Server *server, u64 key, View view)
+{
+    for (u32 i = 0; i < SERVER_CACHE_SLOTS; i++)
+    {
+        CacheEntry *entry = &server->cache[i];
+        if (entry->counts && entry->key == key && views_equal (entry->view, view)) return entry;
+    }
+    return 0;
+}
+
+
+// Call with server->mutex held. Evicts least recently used entries
+// nobody is reading until the new one fits; returns 0 if it can't.
+static CacheEntry *
+insert_cache_entry (Server *server, u64 key, View view, u32 *counts, size_t bytes)
+{
+    CacheEntry *slot = 0;
+    for (;;)
+    {
+        CacheEntry *oldest = 0;
+        slot = 0;
+        for (u32 i = 0; i < SERVER_CACHE_SLOTS; i++)
+        {
+            CacheEntry *entry = &server->cache[i];
+            if (!entry->counts) slot = entry;
+            else if (entry->users == 0 && (!oldest || entry->last_used < oldest->last_used)) oldest = entry;
+        }
+        if (slot && server->cache_bytes + bytes <= SERVER_CACHE_BYTES) break;
+        if (!oldest) break;
+
+        free (oldest->counts);
+        server->cache_bytes -= oldest->bytes;
+        *oldest = {};
+    }
+    if (!slot || server->cache_bytes + bytes > SERVER_CACHE_BYTES) return 0;
+
+    // Slots never move, deliveries keep pointers to them
+    slot->key = key;
+    slot->view = view;
+    slot->counts = counts;
+    slot->bytes = bytes;
+    slot->last_used = server->clock++;
+    slot->users = 0;
+    server->cache_bytes += bytes;
+    return slot;
+}
+
+
+static void
+deliver (ServerThread *thread, ServerWaiter *waiter, View view, u64 key, u32 *counts)
+{
+    set_colors (thread->palette, waiter->palette[0], waiter->palette[1], waiter->palette[2]);
+
+    ExportJob *output = &thread->output;
+    size_t pixels_count = (size_t) view.w * view.h;
+    if (pixels_count > output->pixels_max)
+    {
+        output->pixels_max = pixels_count;
+        output->rgb = (u8 *) realloc (output->rgb, pixels_count * 3);
+    }
+
+    // Counts are bottom row first like Image, files top row first
+    for (u32 y = 0; y < view.h; y++)
+    {
+        u8 *row = output->rgb + (size_t) (view.h - 1 - y) * view.w * 3;
+        for (u32 x = 0; x < view.w; x++)
+        {
+            V3 color = iteration_color (thread->palette, counts[(size_t) y * view.w + x]);
+            row[3*x] = color.r;
+            row[3*x + 1] = color.g;
+            row[3*x + 2] = color.b;
+        }
+    }
+    output->w = view.w;
+    output->h = view.h;
+    output->has_counts = false;
+    output->format = export_format (waiter->output);
+    snprintf (output->filename, sizeof (output->filename), "%s", waiter->output);
+
+    char line[512];
+    if (write_export (&thread->scratch, output))
+    {
+        snprintf (line, sizeof (line), "%s ok %016llx %s %s\n", waiter->id,
+                  (unsigned long long) key, waiter->status, waiter->output);
+    }
+    else snprintf (line, sizeof (line), "%s error can't write %s\n", waiter->id, waiter->output);
+    reply (waiter->client, line);
+}
+
+
+static void
+deliver_all (ServerThread *thread, ServerJob *job, u32 *counts)
+{
+    Server *server = thread->server;
+    for (ServerWaiter *waiter = job->waiters; waiter;)
+    {
+        deliver (thread, waiter, job->view, job->key, counts);
+
+        ServerWaiter *next = waiter->next;
+        SDL_LockMutex (server->mutex);
+        release_client (waiter->client);
+        SDL_UnlockMutex (server->mutex);
+        free (waiter);
+        waiter = next;
+    }
+}
+
+
+// Call with server->mutex held: next cache hit, else the most urgent queued render
+static ServerJob *
+take_job (Server *server)
+{
+    if (server->deliveries)
+    {
+        ServerJob *job = server->deliveries;
+        server->deliveries = job->next;
+        return job;
+    }
+
+    ServerJob *best = 0;
+    for (ServerJob *job = server->jobs; job; job = job->next)
+    {
+        if (job->running) continue;
+        if (!best || job->priority > best->priority ||
+                (job->priority == best->priority && job->sequence < best->sequence)) best = job;
+    }
+    if (best) best->running = true;
+    return best;
+}
+
+
+static int
+server_worker (void *data)
+{
+    ServerThread *thread = (ServerThread *) data;
+    Server *server = thread->server;
+
+    SDL_LockMutex (server->mutex);
+    for (;;)
+    {
+        ServerJob *job = take_job (server);
+        if (!job)
+        {
+            if (server->quit) break;
+            SDL_CondWait (server->cond, server->mutex);
+            continue;
+        }
+        server->busy++;
+
+        if (job->entry)
+        {
+            SDL_UnlockMutex (server->mutex);
+            deliver_all (thread, job, job->entry->counts);
+            SDL_LockMutex (server->mutex);
+            job->entry->users--;
+        }
+        else
+        {
+            SDL_UnlockMutex (server->mutex);
+            size_t bytes = (size_t) job->view.w * job->view.h * sizeof (u32);
+            u32 *counts = (u32 *) malloc (bytes);
+            render_tile (job->view, 0, 0, job->view.w, job->view.h, counts);
+            SDL_LockMutex (server->mutex);
+
+            // From here on new requests for this view hit the cache instead of joining
+            CacheEntry *entry = insert_cache_entry (server, job->key, job->view, counts, bytes);
+            if (entry) entry->users++;
+            for (ServerJob **link = &server->jobs; *link; link = &(*link)->next)
+            {
+                if (*link == job)
+                {
+                    *link = job->next;
+                    break;
+                }
+            }
+
+            SDL_UnlockMutex (server->mutex);
+            deliver_all (thread, job, counts);
+            SDL_LockMutex (server->mutex);
+            if (entry) entry->users--;
+            else free (counts);
+        }
+
+        free (job);
+        server->busy--;
+        SDL_CondBroadcast (server->cond);
+    }
+    SDL_UnlockMutex (server->mutex);
+    return 0;
+}
+
+
+static void
+submit_request (Server *server, ServerClient *client, const char *line)
+{
+    char id[32];
+    s32 priority;
+    View view = {};
+    u32 palette[3];
+    char output[256];
+    char center_x[64], center_y[64];
+    int fields = sscanf (line, "%31s %d %lf %lf %lf %63s %63s %u %u %u %x %x %x %255s",
+                         id, &priority, &view.constant_x, &view.constant_y, &view.scale,
+                         center_x, center_y, &view.w, &view.h, &view.max_iterations,
+                         &palette[0], &palette[1], &palette[2], output);
+    if (fields < 1) return;
+
+    char error[320];
+    if (fields != 14)
+    {
+        snprintf (error, sizeof (error), "%s error expected 14 fields, got %d\n", id, fields);
+        reply (client, error);
+        return;
+    }
+    if (view.w == 0 || view.h == 0 || (size_t) view.w * view.h > SERVER_MAX_PIXELS || !(view.scale > 0))
+    {
+        snprintf (error, sizeof (error), "%s error bad size or scale\n", id);
+        reply (client, error);
+        return;
+    }
+    if (!dd_from_string (center_x, &view.center_x) || !dd_from_string (center_y, &view.center_y))
+    {
+        snprintf (error, sizeof (error), "%s error bad center\n", id);
+        reply (client, error);
+        return;
+    }
+
+    ServerWaiter *waiter = (ServerWaiter *) calloc (1, sizeof (ServerWaiter));
+    waiter->client = client;
+    snprintf (waiter->id, sizeof (waiter->id), "%s", id);
+    memcpy (waiter->palette, palette, sizeof (palette));
+    snprintf (waiter->output, sizeof (waiter->output), "%s", output);
+
+    u64 key = view_key (view);
+
+    SDL_LockMutex (server->mutex);
+    client->references++;
+
+    ServerJob *job = 0;
+    CacheEntry *entry = find_cache_entry (server, key, view);
+    if (entry)
+    {
+        waiter->status = "cached";
+        entry->users++;
+        entry->last_used = server->clock++;
+        job = (ServerJob *) calloc (1, sizeof (ServerJob));
+        job->key = key;
+        job->view = view;
+        job->entry = entry;
+        job->next = server->deliveries;
+        server->deliveries = job;
+    }
+    else
+    {
+        for (job = server->jobs; job && !(job->key == key && views_equal (job->view, view)); job = job->next) {}
+        if (job)
+        {
+            waiter->status = "merged";
+            if (priority > job->priority) job->priority = priority;
+        }
+        else
+        {
+            waiter->status = "rendered";
+            job = (ServerJob *) calloc (1, sizeof (ServerJob));
+            job->key = key;
+            job->view = view;
+            job->priority = priority;
+            job->sequence = server->sequence++;
+            job->next = server->jobs;
+            server->jobs = job;
+        }
+    }
+    waiter->next = job->waiters;
+    job->waiters = waiter;
+
+    SDL_CondSignal (server->cond);
+    SDL_UnlockMutex (server->mutex);
+}
+
+
+static void
+start_server (Server *server, ServerThread *threads)
+{
+    init_crc_table ();
+    server->mutex = SDL_CreateMutex ();
+    server->cond = SDL_CreateCond ();
+
+    for (u32 i = 0; i < SERVER_THREADS; i++)
+    {
+        threads[i].server = server;
+        init_deflate_workers (&threads[i].scratch);
+        server->threads[i] = SDL_CreateThread (server_worker, "server", &threads[i]);
+    }
+}
+
+
+// Waits for every queued job, then stops the pool
+static void
+stop_server (Server *server, ServerThread *threads)
+{
+    SDL_LockMutex (server->mutex);
+    while (server->jobs || server->deliveries || server->busy) SDL_CondWait (server->cond, server->mutex);
+    server->quit = true;
+    SDL_CondBroadcast (server->cond);
+    SDL_UnlockMutex (server->mutex);
+
+    for (u32 i = 0; i < SERVER_THREADS; i++)
+    {
+        SDL_WaitThread (server->threads[i], 0);
+        stop_deflate_workers (&threads[i].scratch);
+    }
+}
+
+
+struct ServerConnection {
+    Server *server;
+    ServerClient *client;
+    FILE *input;
+};
+
+
+// Reads request lines until the client hangs up
+static int
+serve_client (void *data)
+{
+    ServerConnection *connection = (ServerConnection *) data;
+    char line[1024];
+    while (fgets (line, sizeof (line), connection->input))
+    {
+        if (strncmp (line, "quit", 4) == 0) break;
+        submit_request (connection->server, connection->client, line);
+    }
+    fclose (connection->input);
+
+    SDL_LockMutex (connection->server->mutex);
+    release_client (connection->client);
+    SDL_UnlockMutex (connection->server->mutex);
+    free (connection);
+    return 0;
+}
+
+
+static ServerClient *
+new_server_client (int fd)
+{
+    ServerClient *client = (ServerClient *) calloc (1, sizeof (ServerClient));
+    client->fd = fd;
+    client->write_mutex = SDL_CreateMutex ();
+    client->references = 1;
+    return client;
+}
+
+
+// path "-" serves stdin and stdout and returns once stdin ends
+static int
+run_server (const char *path)
+{
+    signal (SIGPIPE, SIG_IGN);
+
+    Server server = {};
+    ServerThread *threads = (ServerThread *) calloc (SERVER_THREADS, sizeof (ServerThread));
+    start_server (&server, threads);
+
+    if (strcmp (path, "-") == 0)
+    {
+        ServerConnection *connection = (ServerConnection *) calloc (1, sizeof (ServerConnection));
+        connection->server = &server;
+        connection->client = new_server_client (1);
+        connection->input = stdin;
+        serve_client (connection);
+        stop_server (&server, threads);
+        return 0;
+    }
+
+    sockaddr_un address;
+    if (!farm_address (path, &address) || !claim_socket_path (path, &address))
+    {
+        stop_server (&server, threads);
+        return 1;
+    }
+    int listener = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 ||
+            bind (listener, (sockaddr *) &address, sizeof (address)) < 0 ||
+            listen (listener, 64) < 0)
+    {
+        fprintf (stderr, "Can't listen on %s: %s\n", path, strerror (errno));
+        return 1;
+    }
+
+    for (;;)
+    {
+        int fd = accept (listener, 0, 0);
+        if (fd < 0)
+        {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        // The reply side keeps fd, requests are read through a stdio copy of it
+        int input_fd = dup (fd);
+        FILE *input = input_fd >= 0 ? fdopen (input_fd, "r") : 0;
+        if (!input)
+        {
+            fprintf (stderr, "Can't read from client: %s\n", strerror (errno));
+            if (input_fd >= 0) close (input_fd);
+            close (fd);
+            continue;
+        }
+
+        ServerConnection *connection = (ServerConnection *) calloc (1, sizeof (ServerConnection));
+        connection->server = &server;
+        connection->client = new_server_client (fd);
+        connection->input = input;
+        SDL_Thread *thread = SDL_CreateThread (serve_client, "client", connection);
+        if (thread) SDL_DetachThread (thread);
+        else serve_client (connection);
+    }
+
+    close (listener);
+    unlink (path);
+    stop_server (&server, threads);
+    return 0;
+}